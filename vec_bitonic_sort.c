@@ -27,7 +27,10 @@
 // Written by Ben Buhrow, July 2025
 // example compile line:
 // clang -O2 -g -march=icelake-client vec_bitonic_sort.c -o vecsort
-// REQUIRES AVX-512 or will fail with illegal instruction 
+// The AVX-512 code is compiled for AVX-512 whatever -march says.
+// sort() and sort32() check the cpu at runtime and fall back to
+// other code without AVX-512; everything else REQUIRES AVX-512 or
+// will fail with illegal instruction.
 
 
 #include <stdio.h>
@@ -54,6 +57,33 @@ typedef uint16_t uint16;
 typedef uint32_t uint32;
 typedef uint64_t uint64;
 
+// the AVX-512 parts of the file are bracketed by these, so they get 
+// compiled for this feature set regardless of the command line.
+// F/CD/BW/DQ/VL is what Skylake-SP and later all have.
+#if defined(__clang__)
+#define AVX512_BEGIN _Pragma("clang attribute push (__attribute__((target(\"avx512f,avx512cd,avx512bw,avx512dq,avx512vl,bmi,bmi2,lzcnt,popcnt\"))), apply_to = function)")
+#define AVX512_END _Pragma("clang attribute pop")
+#elif defined(__GNUC__)
+#define AVX512_BEGIN _Pragma("GCC push_options") \
+	_Pragma("GCC target(\"avx512f,avx512cd,avx512bw,avx512dq,avx512vl,bmi,bmi2,lzcnt,popcnt\")")
+#define AVX512_END _Pragma("GCC pop_options")
+#else
+#define AVX512_BEGIN
+#define AVX512_END
+#endif
+
+// and the AVX2 fallbacks by these
+#if defined(__clang__)
+#define AVX2_BEGIN _Pragma("clang attribute push (__attribute__((target(\"avx2,bmi,bmi2,lzcnt,popcnt\"))), apply_to = function)")
+#define AVX2_END _Pragma("clang attribute pop")
+#elif defined(__GNUC__)
+#define AVX2_BEGIN _Pragma("GCC push_options") _Pragma("GCC target(\"avx2,bmi,bmi2,lzcnt,popcnt\")")
+#define AVX2_END _Pragma("GCC pop_options")
+#else
+#define AVX2_BEGIN
+#define AVX2_END
+#endif
+
 /* #define HAVE_PROF */
 #ifdef HAVE_PROF
 #define SHOW_PROF __attribute__((noinline))
@@ -141,6 +171,8 @@ aligned_malloc(size_t len, uint32 align) {
 	unsigned long addr;
 
 	ptr = malloc(len+align);
+	if (ptr == NULL)
+		return NULL;
 
 	 /* offset to next ALIGN-byte boundary */
 
@@ -251,6 +283,19 @@ uint32_t my_clz32(uint64_t n)
 #endif
 }
 
+uint32_t my_clz64(uint64_t n)
+{
+#if defined(__GNUC__)
+	if (n)
+		return __builtin_clzll(n);
+	return 64;
+#else
+	if ((n >> 32) == 0)
+		return 32 + my_clz32(n);
+	return my_clz32(n >> 32);
+#endif
+}
+
 uint64_t my_ctz32(uint32_t n)
 {
 #if (INLINE_ASM && defined(__x86_64__))
@@ -288,17 +333,20 @@ uint64_t my_ctz32(uint32_t n)
 }
 
 
-uint32_t next_power_2(uint32_t sz)
+size_t next_power_2(size_t sz)
 {
-	uint32_t new_sz = my_clz32(sz);
-	if (new_sz == 0)
+	// the power of 2 above the highest set bit of sz,
+	// or 0 if that does not fit in a size_t.
+	uint32_t lz = my_clz64(sz);
+	if (lz == 0)
 	{
-		printf("buffer too big, sz must be <= 2^31 in sort()\n");
-		exit(0);
+		return 0;
 	}
-	return (1 << (32 - new_sz));
+	return ((size_t)1 << (64 - lz));
 }
 
+AVX512_BEGIN
+
 // intrinsics for swapping N-bit chunks of data within a 512-bit vector
 // that use immediates (faster and fewer registers than needing to load index vectors)
 #define SWAP16(x) _mm512_rol_epi32((x), 16)
@@ -307,11 +355,9 @@ uint32_t next_power_2(uint32_t sz)
 #define SWAP128(x) _mm512_permutex_epi64((x), 0x4E)
 #define SWAP256(x) _mm512_shuffle_i64x2((x), (x), 0x4E)
 
-// intrinsics for swapping N-bit chunks of data within a 512-bit vector, with N < 32.
-// these require index vectors and the additional extension AVX-512BW
-static __m512i swap8bit_idx;
-
-#define SWAP8(x) _mm512_shuffle_epi8((x), swap8bit_idx)
+// swapping 8-bit chunks: rotate each 16-bit lane by 8 with two shifts
+// (AVX-512BW), which avoids a byte shuffle index vector
+#define SWAP8(x) _mm512_or_si512(_mm512_slli_epi16((x), 8), _mm512_srli_epi16((x), 8))
 
 #define SWAP16x2(v1, v2) \
 	dv1_swap = SWAP16(v1);\
@@ -787,6 +833,94 @@ static __m512i swap8bit_idx;
 	v7 = _mm512_mask_max_epu64(t7, m2, v7, dv7_swap);     \
 	v8 = _mm512_mask_max_epu64(t8, m2, v8, dv8_swap); 
 
+// key-value versions of the 64-bit cmp/blend macros.  The masks computed
+// from the keys (dv*) are used to move the values (vv*) as well.
+#define CGT _MM_CMPINT_NLE
+#define CLT _MM_CMPINT_LT
+
+#define SWAPKV64x8(SWAP) \
+	dv1_swap = SWAP(dv1);\
+	dv2_swap = SWAP(dv2);\
+	dv3_swap = SWAP(dv3);\
+	dv4_swap = SWAP(dv4);\
+	dv5_swap = SWAP(dv5);\
+	dv6_swap = SWAP(dv6);\
+	dv7_swap = SWAP(dv7);\
+	dv8_swap = SWAP(dv8);\
+	vv1_swap = SWAP(vv1);\
+	vv2_swap = SWAP(vv2);\
+	vv3_swap = SWAP(vv3);\
+	vv4_swap = SWAP(vv4);\
+	vv5_swap = SWAP(vv5);\
+	vv6_swap = SWAP(vv6);\
+	vv7_swap = SWAP(vv7);\
+	vv8_swap = SWAP(vv8);
+
+// unlike BLENDMASK64, the blend decision of each lane pair is taken from
+// the low lane (P) and copied to its partner D lanes up.  With equal keys
+// m ^ M would otherwise pick the swapped lane on only one side of the pair,
+// which is harmless for keys but duplicates one value and drops the other.
+#define BLENDMASK64_KV(M, P, D) \
+	m1 = (m1 ^ (M)) & (P); m1 |= (m1 << (D));  \
+	m2 = (m2 ^ (M)) & (P); m2 |= (m2 << (D));  \
+	m3 = (m3 ^ (M)) & (P); m3 |= (m3 << (D));  \
+	m4 = (m4 ^ (M)) & (P); m4 |= (m4 << (D));  \
+	m5 = (m5 ^ (M)) & (P); m5 |= (m5 << (D));  \
+	m6 = (m6 ^ (M)) & (P); m6 |= (m6 << (D));  \
+	m7 = (m7 ^ (M)) & (P); m7 |= (m7 << (D));  \
+	m8 = (m8 ^ (M)) & (P); m8 |= (m8 << (D));  \
+	dv1 = _mm512_mask_blend_epi64(m1, dv1, dv1_swap);  \
+	dv2 = _mm512_mask_blend_epi64(m2, dv2, dv2_swap);  \
+	dv3 = _mm512_mask_blend_epi64(m3, dv3, dv3_swap);  \
+	dv4 = _mm512_mask_blend_epi64(m4, dv4, dv4_swap);  \
+	dv5 = _mm512_mask_blend_epi64(m5, dv5, dv5_swap);  \
+	dv6 = _mm512_mask_blend_epi64(m6, dv6, dv6_swap);  \
+	dv7 = _mm512_mask_blend_epi64(m7, dv7, dv7_swap);  \
+	dv8 = _mm512_mask_blend_epi64(m8, dv8, dv8_swap);  \
+	vv1 = _mm512_mask_blend_epi64(m1, vv1, vv1_swap);  \
+	vv2 = _mm512_mask_blend_epi64(m2, vv2, vv2_swap);  \
+	vv3 = _mm512_mask_blend_epi64(m3, vv3, vv3_swap);  \
+	vv4 = _mm512_mask_blend_epi64(m4, vv4, vv4_swap);  \
+	vv5 = _mm512_mask_blend_epi64(m5, vv5, vv5_swap);  \
+	vv6 = _mm512_mask_blend_epi64(m6, vv6, vv6_swap);  \
+	vv7 = _mm512_mask_blend_epi64(m7, vv7, vv7_swap);  \
+	vv8 = _mm512_mask_blend_epi64(m8, vv8, vv8_swap);
+
+// compare two whole key vectors and exchange keys and values:
+// a gets the min for c = CGT and the max for c = CLT.
+#define CMPXCHG64_KV(m, c, a, b, va, vb) \
+	m = _mm512_cmp_epu64_mask(a, b, c);      \
+	t1 = _mm512_mask_blend_epi64(m, a, b);   \
+	b = _mm512_mask_blend_epi64(m, b, a);    \
+	a = t1;                                  \
+	t1 = _mm512_mask_blend_epi64(m, va, vb); \
+	vb = _mm512_mask_blend_epi64(m, vb, va); \
+	va = t1;
+
+// the final (non-alternating) merge phase of a 64-element kv sort
+#define MERGE64_KV(c) \
+	CMPXCHG64_KV(m1, c, dv1, dv5, vv1, vv5); \
+	CMPXCHG64_KV(m2, c, dv2, dv6, vv2, vv6); \
+	CMPXCHG64_KV(m3, c, dv3, dv7, vv3, vv7); \
+	CMPXCHG64_KV(m4, c, dv4, dv8, vv4, vv8); \
+	CMPXCHG64_KV(m1, c, dv1, dv3, vv1, vv3); \
+	CMPXCHG64_KV(m2, c, dv2, dv4, vv2, vv4); \
+	CMPXCHG64_KV(m3, c, dv5, dv7, vv5, vv7); \
+	CMPXCHG64_KV(m4, c, dv6, dv8, vv6, vv8); \
+	CMPXCHG64_KV(m1, c, dv1, dv2, vv1, vv2); \
+	CMPXCHG64_KV(m2, c, dv3, dv4, vv3, vv4); \
+	CMPXCHG64_KV(m3, c, dv5, dv6, vv5, vv6); \
+	CMPXCHG64_KV(m4, c, dv7, dv8, vv7, vv8); \
+	SWAPKV64x8(SWAP256);                     \
+	CMP64(dv1, dv2, dv3, dv4, dv5, dv6, dv7, dv8, c, c, c, c, c, c, c, c); \
+	BLENDMASK64_KV(0xF0, 0x0F, 4);           \
+	SWAPKV64x8(SWAP128);                     \
+	CMP64(dv1, dv2, dv3, dv4, dv5, dv6, dv7, dv8, c, c, c, c, c, c, c, c); \
+	BLENDMASK64_KV(0xCC, 0x33, 2);           \
+	SWAPKV64x8(SWAP64);                      \
+	CMP64(dv1, dv2, dv3, dv4, dv5, dv6, dv7, dv8, c, c, c, c, c, c, c, c); \
+	BLENDMASK64_KV(0xAA, 0x55, 1);
+
 
 #if !defined(__clang__)
 #define _mm512_storeu_epi32 _mm512_store_epi32
@@ -5341,17 +5475,62 @@ void bitonic_sort_dir_64_minmax(uint64_t* data, int dir)
 	return;
 }
 
-void bitonic_merge(uint64_t *data, uint32_t sz, int dir)
+// key transforms for sorting other types with the unsigned
+// kernels.  They are applied to L1-resident blocks just before the
+// base case sorts (forward) and just after the base case merges
+// of the final merge (inverse), so they cost no extra memory passes.
+#define XFORM_NONE 0
+#define XFORM_FLOAT 1
+#define XFORM_SIGNED 2
+
+static void xform64(uint64_t *data, uint32_t sz, int xform, int inverse)
 {
-	if (sz <= 64)
-	{
-		// base case: do the hardcoded 64-element sort
-		bitonic_merge_dir_64(data, dir);
+	// sz is a multiple of 8 and data is aligned.
+	// doubles: flip all bits of negatives and the sign bit of positives.
+	// signed: flip the sign bit.
+	__m512i sign = _mm512_set1_epi64(0x8000000000000000ull);
+	__m512i m = _mm512_setzero_si512();
+	int i;
+
+	if (xform == XFORM_NONE)
 		return;
+
+	for (i = 0; i < sz; i += 8)
+	{
+		__m512i v = _mm512_load_si512(data + i);
+
+		if (xform == XFORM_FLOAT)
+		{
+			if (inverse)
+				m = _mm512_srai_epi64(_mm512_xor_si512(v, sign), 63);
+			else
+				m = _mm512_srai_epi64(v, 63);
+		}
+		v = _mm512_xor_si512(v, _mm512_or_si512(m, sign));
+		_mm512_store_si512(data + i, v);
 	}
-	
-	// half-size cmp/swap
-	int i;
+	return;
+}
+
+static uint64_t xform64_pad(int xform, int dir)
+{
+	// the padding for a front end, in the caller's representation:
+	// the value that transforms to the largest (dir == 0) or 
+	// smallest (dir == 1) key.
+	uint64_t k = (dir == 0) ? 0xffffffffffffffffull : 0;
+	
+	if (xform == XFORM_FLOAT)
+		return k ^ ((uint64_t)((int64_t)(k ^ 0x8000000000000000ull) >> 63) | 0x8000000000000000ull);
+	else if (xform == XFORM_SIGNED)
+		return k ^ 0x8000000000000000ull;
+	return k;
+}
+
+static void bitonic_merge_pass(uint64_t *data, size_t sz, int dir, size_t start, size_t stop)
+{
+	// half-size cmp/swap of bitonic_merge, for the
+	// 128-element batches start to stop - 1 of sz / 128.
+	size_t i;
 
 	// we have sz/2 swaps to do at a stride of sz/2.
 	// the number of swaps will be divisible by 64 because
@@ -5361,7 +5540,7 @@ void bitonic_merge(uint64_t *data, uint32_t sz, int dir)
 	if (dir == 1)
 	{
 		// 128-element merge passes at a stride of sz/2
-		for (i = 0; i < sz / 128; i++)
+		for (i = start; i < stop; i++)
 		{
 			__m512i t1;
 			__m512i t2;
@@ -5477,7 +5656,7 @@ void bitonic_merge(uint64_t *data, uint32_t sz, int dir)
 	else
 	{
 		// 128-element merge passes at a stride of sz/2
-		for (i = 0; i < sz / 128; i++)
+		for (i = start; i < stop; i++)
 		{
 			__m512i t1;
 			__m512i t2;
@@ -5589,10 +5768,28 @@ void bitonic_merge(uint64_t *data, uint32_t sz, int dir)
 
 		}
 	}
+}
+
+static void bitonic_merge_xf(uint64_t *data, size_t sz, int dir, int xout)
+{
+	if (sz <= 64)
+	{
+		// base case: do the hardcoded 64-element sort
+		bitonic_merge_dir_64(data, dir);
+		xform64(data, sz, xout, 1);
+		return;
+	}
+	
+	bitonic_merge_pass(data, sz, dir, 0, sz / 128);
 
 	// two parallel half-size merges
-	bitonic_merge(data, sz / 2, dir);
-	bitonic_merge(data + sz / 2, sz / 2, dir);
+	bitonic_merge_xf(data, sz / 2, dir, xout);
+	bitonic_merge_xf(data + sz / 2, sz / 2, dir, xout);
+}
+
+void bitonic_merge(uint64_t *data, size_t sz, int dir)
+{
+	bitonic_merge_xf(data, sz, dir, XFORM_NONE);
 }
 
 void L1sort(uint64_t *data, int dir)
@@ -5623,12 +5820,16 @@ void L1sort(uint64_t *data, int dir)
 }
 		
 //#define non_recursive
-void bitonic_sort(uint64_t *data, uint32_t sz, int dir)
+static void bitonic_sort_xf(uint64_t *data, size_t sz, int dir, int xin, int xout)
 {
+	// xin is applied to the input of the base case sorts and
+	// xout to the output of the final merge.
 	if (sz == 64)
 	{
 		// base case: do the hardcoded 64-element sort
+		xform64(data, sz, xin, 0);
 		bitonic_sort_dir_64(data, dir);
+		xform64(data, sz, xout, 1);
 		return;
 	}
 	
@@ -5638,23 +5839,24 @@ void bitonic_sort(uint64_t *data, uint32_t sz, int dir)
 	{	
 		// two half-size bitonic sorts,
 		// with opposite directions.
-		bitonic_sort(data, sz / 2, 0);
-		bitonic_sort(data + sz / 2, sz / 2, 1);
+		bitonic_sort_xf(data, sz / 2, 0, xin, XFORM_NONE);
+		bitonic_sort_xf(data + sz / 2, sz / 2, 1, xin, XFORM_NONE);
 		
 		// merge in the specified direction
-		bitonic_merge(data, sz, dir);
+		bitonic_merge_xf(data, sz, dir, xout);
 	}
 	else
 	{
 		// to make this more cache-friendly, get L1-sized chunks up/down sorted
 		// and then merge those together.  L1 is typically 4096 uint64_t's (32k bytes).
-		int j;
+		size_t j;
 		for (j = 0; j < sz / 4096; j++) {
 			// alternating up/down sorts so we can finish using merge only
+			xform64(data + j * 4096, 4096, xin, 0);
 			L1sort(data + j * 4096, j & 1);
 		}
 		
-		uint32_t bitonic_sort_size = 8192;
+		size_t bitonic_sort_size = 8192;
 		while (bitonic_sort_size < sz)
 		{
 			for (j = 0; j < sz / bitonic_sort_size; j++) {
@@ -5665,52 +5867,294 @@ void bitonic_sort(uint64_t *data, uint32_t sz, int dir)
 		}
 		
 		// final merge in the specified direction
-		bitonic_merge(data, sz, dir);
+		bitonic_merge_xf(data, sz, dir, xout);
 		return;
 	}
 #else
 	
 	// two half-size bitonic sorts,
 	// with opposite directions.
-	bitonic_sort(data, sz / 2, 0);
-	bitonic_sort(data + sz / 2, sz / 2, 1);
+	bitonic_sort_xf(data, sz / 2, 0, xin, XFORM_NONE);
+	bitonic_sort_xf(data + sz / 2, sz / 2, 1, xin, XFORM_NONE);
 	
 	// merge in the specified direction
-	bitonic_merge(data, sz, dir);
+	bitonic_merge_xf(data, sz, dir, xout);
 #endif
 
 	return;
 }
 
-void sort(uint64_t *data, uint32_t sz, int dir)
+void bitonic_sort(uint64_t *data, size_t sz, int dir)
+{
+	bitonic_sort_xf(data, sz, dir, XFORM_NONE, XFORM_NONE);
+}
+
+static __inline void merge8x8_64(__m512i *a, __m512i *b, __mmask8 d)
+{
+	// merge two vectors each sorted in direction dir (d = 0 or 0xff)
+	// into 16 sorted elements: the first 8 in *a and the last 8 in *b.
+	// reverse b and do one cmp/swap so that both halves are bitonic,
+	// then finish each half with the 3-stage in-register merge.
+	__m512i rev = _mm512_setr_epi64(7, 6, 5, 4, 3, 2, 1, 0);
+	__m512i x = *a;
+	__m512i y = _mm512_permutexvar_epi64(rev, *b);
+	__m512i mn = _mm512_min_epu64(x, y);
+	__m512i mx = _mm512_max_epu64(x, y);
+	__m512i s1, s2;
+	
+	x = _mm512_mask_blend_epi64(d, mn, mx);
+	y = _mm512_mask_blend_epi64(d, mx, mn);
+	
+	s1 = SWAP256(x);
+	s2 = SWAP256(y);
+	x = _mm512_mask_blend_epi64(0xF0 ^ d, _mm512_min_epu64(x, s1), _mm512_max_epu64(x, s1));
+	y = _mm512_mask_blend_epi64(0xF0 ^ d, _mm512_min_epu64(y, s2), _mm512_max_epu64(y, s2));
+	
+	s1 = SWAP128(x);
+	s2 = SWAP128(y);
+	x = _mm512_mask_blend_epi64(0xCC ^ d, _mm512_min_epu64(x, s1), _mm512_max_epu64(x, s1));
+	y = _mm512_mask_blend_epi64(0xCC ^ d, _mm512_min_epu64(y, s2), _mm512_max_epu64(y, s2));
+	
+	s1 = SWAP64(x);
+	s2 = SWAP64(y);
+	x = _mm512_mask_blend_epi64(0xAA ^ d, _mm512_min_epu64(x, s1), _mm512_max_epu64(x, s1));
+	y = _mm512_mask_blend_epi64(0xAA ^ d, _mm512_min_epu64(y, s2), _mm512_max_epu64(y, s2));
+	
+	*a = x;
+	*b = y;
+	return;
+}
+
+// true if x sorts after y in direction dir
+#define AFTER(x, y, dir) ((dir) ? ((x) < (y)) : ((x) > (y)))
+
+static void merge_backward64(uint64_t *data, size_t nl, size_t nr, uint64_t *scratch, int dir)
+{
+	// merge the sorted runs data[0..nl) and data[nl..nl+nr), nr <= nl,
+	// in place.  the right run is copied to scratch and the output is 
+	// written from the end, 8 at a time while both runs have 8 left, 
+	// so it never overtakes the unread part of the left run.
+	__attribute__((aligned(64))) uint64_t carry[8];
+	__mmask8 d = (dir == 0) ? 0 : 0xff;
+	uint64_t *L = data;
+	uint64_t *R = scratch;
+	size_t o = nl + nr;
+	size_t nc = 0;
+	
+	memcpy(R, data + nl, nr * sizeof(uint64_t));
+	
+	if ((nl >= 8) && (nr >= 8))
+	{
+		__m512i c;
+		__m512i v;
+		
+		nl -= 8;
+		nr -= 8;
+		c = _mm512_loadu_si512(L + nl);
+		v = _mm512_loadu_si512(R + nr);
+		merge8x8_64(&c, &v, d);
+		o -= 8;
+		_mm512_storeu_si512(data + o, v);
+		
+		while ((nl >= 8) && (nr >= 8))
+		{
+			if (AFTER(L[nl - 1], R[nr - 1], dir))
+			{
+				nl -= 8;
+				v = _mm512_loadu_si512(L + nl);
+			}
+			else
+			{
+				nr -= 8;
+				v = _mm512_loadu_si512(R + nr);
+			}
+			merge8x8_64(&c, &v, d);
+			o -= 8;
+			_mm512_storeu_si512(data + o, v);
+		}
+		
+		_mm512_store_si512(carry, c);
+		nc = 8;
+	}
+	
+	// scalar 3-way merge of what is left.  once the right run and the 
+	// carry are used up the rest of the left run is already in place.
+	while ((nr + nc) > 0)
+	{
+		uint64_t v;
+		
+		if ((nl == 0) && (nc == 0))
+		{
+			memcpy(data, R, nr * sizeof(uint64_t));
+			break;
+		}
+		
+		if ((nl > 0) && 
+			((nr == 0) || !AFTER(R[nr - 1], L[nl - 1], dir)) &&
+			((nc == 0) || !AFTER(carry[nc - 1], L[nl - 1], dir)))
+		{
+			v = L[--nl];
+		}
+		else if ((nr > 0) && ((nc == 0) || !AFTER(carry[nc - 1], R[nr - 1], dir)))
+		{
+			v = R[--nr];
+		}
+		else
+		{
+			v = carry[--nc];
+		}
+		data[--o] = v;
+	}
+	
+	return;
+}
+
+static void sort_small64_xf(uint64_t *data, uint32_t sz, int dir, int xform)
+{
+	// sz <= 64, any alignment: masked loads into an aligned stack
+	// buffer with the lanes past sz filled with the padding, 
+	// the base case sort, and masked stores back.
+	__attribute__((aligned(64))) uint64_t buf[64];
+	__m512i pad = _mm512_set1_epi64(xform64_pad(xform, dir));
+	uint32_t i;
+	
+	for (i = 0; i < 64; i += 8)
+	{
+		__mmask8 m = (sz >= i + 8) ? 0xff : (sz > i) ? (1 << (sz - i)) - 1 : 0;
+		_mm512_store_si512(buf + i, _mm512_mask_loadu_epi64(pad, m, data + i));
+	}
+	
+	xform64(buf, 64, xform, 0);
+	bitonic_sort_dir_64(buf, dir);
+	xform64(buf, 64, xform, 1);
+	
+	for (i = 0; i < sz; i += 8)
+	{
+		__mmask8 m = (sz >= i + 8) ? 0xff : (1 << (sz - i)) - 1;
+		_mm512_mask_storeu_epi64(data + i, m, _mm512_load_si512(buf + i));
+	}
+	return;
+}
+
+void bitonic_sort_dir_64_masked(uint64_t *data, uint32_t sz, int dir)
+{
+	// unaligned and/or partially filled (sz <= 64) entry point 
+	// to bitonic_sort_dir_64.  sorts in place, no heap.
+	sort_small64_xf(data, sz, dir, XFORM_NONE);
+}
+
+static void merge_head64(uint64_t *data, uint32_t h, size_t sz, int dir)
+{
+	// merge a short sorted head data[0..h), h <= 8, into the sorted 
+	// run data[h..h+sz) in place.  each head element is placed after 
+	// a binary search, with the run elements before it moved down.
+	uint64_t head[8];
+	uint64_t *R = data + h;
+	uint32_t i;
+	size_t o = 0, r = 0;
+	
+	memcpy(head, data, h * sizeof(uint64_t));
+	
+	for (i = 0; i < h; i++)
+	{
+		size_t lo = r, hi = sz;
+		
+		// first run element that sorts after head[i]
+		while (lo < hi)
+		{
+			size_t mid = lo + (hi - lo) / 2;
+			if (AFTER(R[mid], head[i], dir))
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		
+		memmove(data + o, R + r, (lo - r) * sizeof(uint64_t));
+		o += lo - r;
+		r = lo;
+		data[o++] = head[i];
+	}
+	
+	return;
+}
+
+static void xform64_any(uint64_t *data, size_t sz, int xform, int inverse)
+{
+	// aligned data, any sz: xform64 a chunk at a time, with the 
+	// partial vector at the end done in an aligned stack buffer.
+	__attribute__((aligned(64))) uint64_t buf[8];
+	size_t n = sz & ~(size_t)7;
+	size_t i;
+	
+	if (xform == XFORM_NONE)
+		return;
+	
+	for (i = 0; i < n; i += 4096)
+		xform64(data + i, ((n - i) < 4096) ? (n - i) : 4096, xform, inverse);
+	
+	if (sz > n)
+	{
+		memcpy(buf, data + n, (sz - n) * sizeof(uint64_t));
+		xform64(buf, 8, xform, inverse);
+		memcpy(data + n, buf, (sz - n) * sizeof(uint64_t));
+	}
+	return;
+}
+
+static int sort_xf(uint64_t *data, size_t sz, int dir, int xform)
 {
 	// top level sort dealing with two things:
 	// 1) the bitonic sort function requires the data array
 	// to be aligned and
-	// 2) the bitonic sort works on a power-of-2 sized array
-	// here we make sure we feed the bitonic sort function
-	// an array that satifies those requirements.
+	// 2) the bitonic sort works on a power-of-2 sized array.
+	// unaligned data is copied to an aligned buffer.  other sizes
+	// are sorted as power-of-2 blocks, largest first in address order,
+	// plus a tail of < 64 elements, and then merged right to left.  
+	// Each merge then has a right run smaller than its left run, and
+	// the cost scales with sz instead of the next power of 2.
+	// The transform is applied on the way into the base cases and 
+	// the merges work on transformed keys, so for those sizes the 
+	// inverse costs one extra pass at the end.
 	int is_aligned = (((uint64_t)data & 0x3full) == 0);
+	
+	if (sz <= 64)
+	{
+		sort_small64_xf(data, sz, dir, xform);
+		return 0;
+	}
+	
 	if (is_aligned && ((sz & (sz - 1)) == 0))
 	{
 		// meets both requirements as-is
-		bitonic_sort(data, sz, dir);
-		return;
+		bitonic_sort_xf(data, sz, dir, xform, xform);
+		return 0;
 	}
 	
-	// otherwise we need to copy to an aligned buffer and/or 
-	// change the buffer size
-	uint32_t new_sz = sz;
-	if ((sz & (sz - 1)) > 0)
+	if (!is_aligned && (xform == XFORM_NONE) && (((uint64_t)data & 0x7ull) == 0))
 	{
-		new_sz = next_power_2(sz);
+		// sort the head up to the first 64-byte boundary with 
+		// masked loads and the now-aligned rest in place, 
+		// then merge the head in.  merge_head64 compares the
+		// keys as stored, so this is only for untransformed sorts.
+		uint32_t h = (64 - ((uint64_t)data & 0x3full)) / sizeof(uint64_t);
+		
+		sort_small64_xf(data, h, dir, XFORM_NONE);
+		if (sort_xf(data + h, sz - h, dir, XFORM_NONE) != 0)
+			return -1;
+		merge_head64(data, h, sz - h, dir);
+		return 0;
 	}
-		
+	
 	uint64_t *adata;
+	uint64_t *scratch = NULL;
+	size_t top = (size_t)1 << (63 - my_clz64(sz));
+	size_t b, pos, tail;
 	
 	if (!is_aligned)
 	{
-		adata = (uint64_t*)aligned_malloc(new_sz * sizeof(uint64_t), 64);
+		adata = (uint64_t*)aligned_malloc(sz * sizeof(uint64_t), 64);
+		if (adata == NULL)
+			return -1;
 		memcpy(adata, data, sz * sizeof(uint64_t));
 	}
 	else
@@ -5718,15 +6162,57 @@ void sort(uint64_t *data, uint32_t sz, int dir)
 		adata = data;
 	}
 	
-	if ((new_sz - sz) > 0)
+	// runs to the right of the top block add up to less than it
+	if (sz > top)
 	{
-		if (dir == 0)
-			memset(adata + sz, 0xff, (new_sz - sz) * sizeof(uint64));
-		else
-			memset(adata + sz, 0, (new_sz - sz) * sizeof(uint64));
+		scratch = (uint64_t*)aligned_malloc((sz - top) * sizeof(uint64_t), 64);
+		if (scratch == NULL)
+		{
+			if (!is_aligned)
+				aligned_free(adata);
+			return -1;
+		}
+	}
+	
+	for (b = top, pos = 0; b >= 64; b >>= 1)
+	{
+		if (sz & b)
+		{
+			bitonic_sort_xf(adata + pos, b, dir, xform, (b == sz) ? xform : XFORM_NONE);
+			pos += b;
+		}
+	}
+	
+	tail = sz - pos;
+	if (tail > 0)
+	{
+		// the padding for XFORM_NONE is right for transformed keys
+		xform64_any(adata + pos, tail, xform, 0);
+		sort_small64_xf(adata + pos, tail, dir, XFORM_NONE);
+	}
+	
+	for (b = 64; b <= top; b <<= 1)
+	{
+		if (sz & b)
+		{
+			pos -= b;
+			if (tail > 0)
+			{
+				merge_backward64(adata + pos, b, tail, scratch, dir);
+			}
+			tail += b;
+		}
+	}
+	
+	if (sz > top)
+	{
+		xform64_any(adata, sz, xform, 1);
 	}
 	
-	bitonic_sort(adata, new_sz, dir);
+	if (scratch != NULL)
+	{
+		aligned_free(scratch);
+	}
 	
 	if (!is_aligned)
 	{
@@ -5734,31 +6220,48 @@ void sort(uint64_t *data, uint32_t sz, int dir)
 		aligned_free(adata);
 	}
 	
-	return;
+	return 0;
 }
 
-void bitonic_merge16(uint16_t *data, uint32_t sz, int dir)
+static int sort_avx512(uint64_t *data, size_t sz, int dir)
 {
-	if (sz <= 64)
-	{
-		// base case: do the hardcoded 128-element sort
-		bitonic_merge16_dir_64(data, dir);
-		return;
-	}
-	else if (sz <= 128)
-	{
-		// base case: do the hardcoded 128-element sort
-		bitonic_merge16_dir_128(data, dir);
+	return sort_xf(data, sz, dir, XFORM_NONE);
+}
+
+int sortf64(double *data, size_t sz, int dir)
+{
+	// sort 64-bit IEEE doubles, same ordering as sortf32.
+	return sort_xf((uint64_t *)data, sz, dir, XFORM_FLOAT);
+}
+
+int sorti64(int64_t *data, size_t sz, int dir)
+{
+	// signed 64-bit sort, arbitrary size and alignment
+	return sort_xf((uint64_t *)data, sz, dir, XFORM_SIGNED);
+}
+
+static void xform16(uint16_t *data, uint32_t sz, int xform)
+{
+	// sz is a multiple of 32 and data is aligned.
+	// signed: flip the sign bit (its own inverse).
+	__m512i sign = _mm512_set1_epi16(0x8000);
+	int i;
+
+	if (xform == XFORM_NONE)
 		return;
-	}
-	else if (sz <= 256)
+
+	for (i = 0; i < sz; i += 32)
 	{
-		// base case: do the hardcoded 128-element sort
-		bitonic_merge16_dir_256(data, dir);
-		return;
+		_mm512_store_si512(data + i, 
+			_mm512_xor_si512(_mm512_load_si512(data + i), sign));
 	}
-	
-	// half-size cmp/swap
+	return;
+}
+
+static void bitonic_merge16_pass(uint16_t *data, uint32_t sz, int dir, uint32_t start, uint32_t stop)
+{
+	// half-size cmp/swap of bitonic_merge16, for the
+	// 512-element batches start to stop - 1 of sz / 512.
 	int i;
 
 	// we have sz/2 swaps to do at a stride of sz/2.
@@ -5794,7 +6297,7 @@ void bitonic_merge16(uint16_t *data, uint32_t sz, int dir)
 	if (dir == 1)
 	{
 		// 512-element merge passes at a stride of sz/2
-		for (i = 0; i < sz / 512; i++)
+		for (i = start; i < stop; i++)
 		{
 			// swap 128 elements at starting offset i * 128
 			dv1 = _mm512_load_si512(data + i * 256 +  0);
@@ -5865,7 +6368,7 @@ void bitonic_merge16(uint16_t *data, uint32_t sz, int dir)
 	else
 	{
 		// 256-element merge passes at a stride of sz/2
-		for (i = 0; i < sz / 512; i++)
+		for (i = start; i < stop; i++)
 		{
 			// swap 128 elements at starting offset i * 128
 			dv1 = _mm512_load_si512(data + i * 256 +  0);
@@ -5934,60 +6437,696 @@ void bitonic_merge16(uint16_t *data, uint32_t sz, int dir)
 
 		}
 	}
-
-	// two parallel half-size merges
-	bitonic_merge16(data, sz / 2, dir);
-	bitonic_merge16(data + sz / 2, sz / 2, dir);
 }
 
-void bitonic_sort16(uint16_t *data, uint32_t sz, int dir)
+static void bitonic_merge16_xf(uint16_t *data, uint32_t sz, int dir, int xout)
 {
-	if (sz == 64)
+	if (sz <= 64)
 	{
-		// base case: do the hardcoded 128-element sort
-		bitonic_sort16_dir_64(data, dir);
+		// base case: do the hardcoded 64-element sort
+		bitonic_merge16_dir_64(data, dir);
+		xform16(data, sz, xout);
 		return;
 	}
-	else if (sz == 128)
+	else if (sz <= 128)
 	{
 		// base case: do the hardcoded 128-element sort
-		bitonic_sort16_dir_128(data, dir);
+		bitonic_merge16_dir_128(data, dir);
+		xform16(data, sz, xout);
 		return;
 	}
-	else if (sz == 256)
+	else if (sz <= 256)
 	{
-		// base case: do the hardcoded 128-element sort
-		bitonic_sort16_dir_256(data, dir);
+		// base case: do the hardcoded 256-element sort
+		bitonic_merge16_dir_256(data, dir);
+		xform16(data, sz, xout);
+		return;
+	}
+	
+	bitonic_merge16_pass(data, sz, dir, 0, sz / 512);
+
+	// two parallel half-size merges
+	bitonic_merge16_xf(data, sz / 2, dir, xout);
+	bitonic_merge16_xf(data + sz / 2, sz / 2, dir, xout);
+}
+
+void bitonic_merge16(uint16_t *data, uint32_t sz, int dir)
+{
+	bitonic_merge16_xf(data, sz, dir, XFORM_NONE);
+}
+
+static void bitonic_sort16_xf(uint16_t *data, uint32_t sz, int dir, int xin, int xout)
+{
+	// xin is applied to the input of the base case sorts and
+	// xout to the output of the final merge.
+	if (sz <= 256)
+	{
+		xform16(data, sz, xin);
+		
+		if (sz == 64)
+		{
+			// base case: do the hardcoded 64-element sort
+			bitonic_sort16_dir_64(data, dir);
+		}
+		else if (sz == 128)
+		{
+			// base case: do the hardcoded 128-element sort
+			bitonic_sort16_dir_128(data, dir);
+		}
+		else
+		{
+			// base case: do the hardcoded 256-element sort
+			bitonic_sort16_dir_256(data, dir);
+		}
+		
+		xform16(data, sz, xout);
 		return;
 	}
 
 	// two half-size bitonic sorts,
 	// with opposite directions.
-	bitonic_sort16(data, sz / 2, 0);
-	bitonic_sort16(data + sz / 2, sz / 2, 1);
+	bitonic_sort16_xf(data, sz / 2, 0, xin, XFORM_NONE);
+	bitonic_sort16_xf(data + sz / 2, sz / 2, 1, xin, XFORM_NONE);
 
 	// merge in the specified direction
-	bitonic_merge16(data, sz, dir);
+	bitonic_merge16_xf(data, sz, dir, xout);
 
 	return;
 }
 
-void bitonic_merge32(uint32_t *data, uint32_t sz, int dir)
+void bitonic_sort16(uint16_t *data, uint32_t sz, int dir)
 {
-	if (sz <= 64)
+	bitonic_sort16_xf(data, sz, dir, XFORM_NONE, XFORM_NONE);
+}
+
+static void sort_small16_xf(uint16_t *data, uint32_t sz, int dir, int xform)
+{
+	// sz <= 256, any alignment: as sort_small64_xf, using the
+	// smallest base case that holds sz.
+	__attribute__((aligned(64))) uint16_t buf[256];
+	uint16_t p = (dir == 0) ? 0xffff : 0;
+	__m512i pad;
+	uint32_t i, n = 64;
+	
+	if (xform == XFORM_SIGNED)
+		p ^= 0x8000;
+	pad = _mm512_set1_epi16(p);
+	
+	while (n < sz)
+		n *= 2;
+	
+	for (i = 0; i < n; i += 32)
 	{
-		// base case: do the hardcoded 128-element sort
-		bitonic_merge32_dir_64(data, dir);
-		return;
+		__mmask32 m = (sz >= i + 32) ? 0xffffffff : (sz > i) ? (1u << (sz - i)) - 1 : 0;
+		_mm512_store_si512(buf + i, _mm512_mask_loadu_epi16(pad, m, data + i));
 	}
-	else if (sz <= 128)
+	
+	xform16(buf, n, xform);
+	if (n == 64)
+		bitonic_sort16_dir_64(buf, dir);
+	else if (n == 128)
+		bitonic_sort16_dir_128(buf, dir);
+	else
+		bitonic_sort16_dir_256(buf, dir);
+	xform16(buf, n, xform);
+	
+	for (i = 0; i < sz; i += 32)
 	{
-		// base case: do the hardcoded 128-element sort
-		bitonic_merge32_dir_128(data, dir);
+		__mmask32 m = (sz >= i + 32) ? 0xffffffff : (1u << (sz - i)) - 1;
+		_mm512_mask_storeu_epi16(data + i, m, _mm512_load_si512(buf + i));
+	}
+	return;
+}
+
+void bitonic_sort16_dir_256_masked(uint16_t *data, uint32_t sz, int dir)
+{
+	// unaligned and/or partially filled (sz <= 256) entry point 
+	// to the 16-bit base cases.  sorts in place, no heap.
+	sort_small16_xf(data, sz, dir, XFORM_NONE);
+}
+
+static __inline void merge32x32_16(__m512i *a, __m512i *b, __mmask32 d)
+{
+	// 16-bit version of merge8x8_64, d = 0 or 0xffffffff
+	__m512i rev = _mm512_set_epi16(0, 1, 2, 3, 4, 5, 6, 7, 
+		8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 
+		24, 25, 26, 27, 28, 29, 30, 31);
+	__m512i x = *a;
+	__m512i y = _mm512_permutexvar_epi16(rev, *b);
+	__m512i mn = _mm512_min_epu16(x, y);
+	__m512i mx = _mm512_max_epu16(x, y);
+	__m512i s1, s2;
+	
+	x = _mm512_mask_blend_epi16(d, mn, mx);
+	y = _mm512_mask_blend_epi16(d, mx, mn);
+	
+	s1 = SWAP256(x);
+	s2 = SWAP256(y);
+	x = _mm512_mask_blend_epi16(0xFFFF0000 ^ d, _mm512_min_epu16(x, s1), _mm512_max_epu16(x, s1));
+	y = _mm512_mask_blend_epi16(0xFFFF0000 ^ d, _mm512_min_epu16(y, s2), _mm512_max_epu16(y, s2));
+	
+	s1 = SWAP128(x);
+	s2 = SWAP128(y);
+	x = _mm512_mask_blend_epi16(0xFF00FF00 ^ d, _mm512_min_epu16(x, s1), _mm512_max_epu16(x, s1));
+	y = _mm512_mask_blend_epi16(0xFF00FF00 ^ d, _mm512_min_epu16(y, s2), _mm512_max_epu16(y, s2));
+	
+	s1 = SWAP64(x);
+	s2 = SWAP64(y);
+	x = _mm512_mask_blend_epi16(0xF0F0F0F0 ^ d, _mm512_min_epu16(x, s1), _mm512_max_epu16(x, s1));
+	y = _mm512_mask_blend_epi16(0xF0F0F0F0 ^ d, _mm512_min_epu16(y, s2), _mm512_max_epu16(y, s2));
+	
+	s1 = SWAP32(x);
+	s2 = SWAP32(y);
+	x = _mm512_mask_blend_epi16(0xCCCCCCCC ^ d, _mm512_min_epu16(x, s1), _mm512_max_epu16(x, s1));
+	y = _mm512_mask_blend_epi16(0xCCCCCCCC ^ d, _mm512_min_epu16(y, s2), _mm512_max_epu16(y, s2));
+	
+	s1 = SWAP16(x);
+	s2 = SWAP16(y);
+	x = _mm512_mask_blend_epi16(0xAAAAAAAA ^ d, _mm512_min_epu16(x, s1), _mm512_max_epu16(x, s1));
+	y = _mm512_mask_blend_epi16(0xAAAAAAAA ^ d, _mm512_min_epu16(y, s2), _mm512_max_epu16(y, s2));
+	
+	*a = x;
+	*b = y;
+	return;
+}
+
+static void merge_forward16(uint16_t *out, uint16_t *a, size_t na, uint16_t *b, size_t nb, int dir)
+{
+	// 16-bit version of merge_forward64, 32 at a time
+	__attribute__((aligned(64))) uint16_t carry[32];
+	uint16_t small[64];
+	__mmask32 d = (dir == 0) ? 0 : 0xffffffff;
+	size_t ia = 0, ib = 0, o = 0, nc = 0, ns = 0, ic = 0, ir = 0, k = 0;
+	size_t nr, nbig, s;
+	uint16_t *r, *big;
+	
+	if ((na >= 32) && (nb >= 32))
+	{
+		__m512i v = _mm512_loadu_si512(a);
+		__m512i c = _mm512_loadu_si512(b);
+		
+		ia = 32;
+		ib = 32;
+		merge32x32_16(&v, &c, d);
+		_mm512_storeu_si512(out, v);
+		o = 32;
+		
+		while ((ia + 32 <= na) && (ib + 32 <= nb))
+		{
+			if (AFTER(a[ia], b[ib], dir))
+			{
+				v = _mm512_loadu_si512(b + ib);
+				ib += 32;
+			}
+			else
+			{
+				v = _mm512_loadu_si512(a + ia);
+				ia += 32;
+			}
+			merge32x32_16(&v, &c, d);
+			_mm512_storeu_si512(out + o, v);
+			o += 32;
+		}
+		
+		_mm512_store_si512(carry, c);
+		nc = 32;
+	}
+	
+	if ((na - ia) <= (nb - ib))
+	{
+		r = a + ia;
+		nr = na - ia;
+		big = b + ib;
+		nbig = nb - ib;
+	}
+	else
+	{
+		r = b + ib;
+		nr = nb - ib;
+		big = a + ia;
+		nbig = na - ia;
+	}
+	
+	while ((ic < nc) || (ir < nr))
+	{
+		if ((ir == nr) || ((ic < nc) && !AFTER(carry[ic], r[ir], dir)))
+			small[ns++] = carry[ic++];
+		else
+			small[ns++] = r[ir++];
+	}
+	
+	for (s = 0; s < ns; s++)
+	{
+		size_t lo = k, hi = nbig;
+		
+		// first element of the long remainder that sorts after small[s]
+		while (lo < hi)
+		{
+			size_t mid = lo + (hi - lo) / 2;
+			if (AFTER(big[mid], small[s], dir))
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		
+		memcpy(out + o, big + k, (lo - k) * sizeof(uint16_t));
+		o += lo - k;
+		k = lo;
+		out[o++] = small[s];
+	}
+	memcpy(out + o, big + k, (nbig - k) * sizeof(uint16_t));
+	
+	return;
+}
+
+static void merge_backward16(uint16_t *data, uint32_t nl, uint32_t nr, uint16_t *scratch, int dir)
+{
+	// 16-bit version of merge_backward64, 32 at a time
+	__attribute__((aligned(64))) uint16_t carry[32];
+	__mmask32 d = (dir == 0) ? 0 : 0xffffffff;
+	uint16_t *L = data;
+	uint16_t *R = scratch;
+	uint32_t o = nl + nr;
+	uint32_t nc = 0;
+	
+	memcpy(R, data + nl, nr * sizeof(uint16_t));
+	
+	if ((nl >= 32) && (nr >= 32))
+	{
+		__m512i c;
+		__m512i v;
+		
+		nl -= 32;
+		nr -= 32;
+		c = _mm512_loadu_si512(L + nl);
+		v = _mm512_loadu_si512(R + nr);
+		merge32x32_16(&c, &v, d);
+		o -= 32;
+		_mm512_storeu_si512(data + o, v);
+		
+		while ((nl >= 32) && (nr >= 32))
+		{
+			if (AFTER(L[nl - 1], R[nr - 1], dir))
+			{
+				nl -= 32;
+				v = _mm512_loadu_si512(L + nl);
+			}
+			else
+			{
+				nr -= 32;
+				v = _mm512_loadu_si512(R + nr);
+			}
+			merge32x32_16(&c, &v, d);
+			o -= 32;
+			_mm512_storeu_si512(data + o, v);
+		}
+		
+		_mm512_store_si512(carry, c);
+		nc = 32;
+	}
+	
+	while ((nr + nc) > 0)
+	{
+		uint16_t v;
+		
+		if ((nl == 0) && (nc == 0))
+		{
+			memcpy(data, R, nr * sizeof(uint16_t));
+			break;
+		}
+		
+		if ((nl > 0) && 
+			((nr == 0) || !AFTER(R[nr - 1], L[nl - 1], dir)) &&
+			((nc == 0) || !AFTER(carry[nc - 1], L[nl - 1], dir)))
+		{
+			v = L[--nl];
+		}
+		else if ((nr > 0) && ((nc == 0) || !AFTER(carry[nc - 1], R[nr - 1], dir)))
+		{
+			v = R[--nr];
+		}
+		else
+		{
+			v = carry[--nc];
+		}
+		data[--o] = v;
+	}
+	
+	return;
+}
+
+static void xform16_any(uint16_t *data, uint32_t sz, int xform)
+{
+	// see xform64_any
+	__attribute__((aligned(64))) uint16_t buf[32];
+	uint32_t n = sz & ~31u;
+	uint32_t i;
+	
+	if (xform == XFORM_NONE)
 		return;
+	
+	for (i = 0; i < n; i += 4096)
+		xform16(data + i, ((n - i) < 4096) ? (n - i) : 4096, xform);
+	
+	if (sz > n)
+	{
+		memcpy(buf, data + n, (sz - n) * sizeof(uint16_t));
+		xform16(buf, 32, xform);
+		memcpy(data + n, buf, (sz - n) * sizeof(uint16_t));
+	}
+	return;
+}
+
+static int sort16_xf(uint16_t *data, uint32_t sz, int dir, int xform)
+{
+	// top level 16-bit sort, same approach as sort_xf() but without
+	// the in-place head for unaligned data.
+	int is_aligned = (((uint64_t)data & 0x3full) == 0);
+	
+	if (sz <= 256)
+	{
+		sort_small16_xf(data, sz, dir, xform);
+		return 0;
 	}
 	
-	// half-size cmp/swap
+	if (is_aligned && ((sz & (sz - 1)) == 0))
+	{
+		// meets both requirements as-is
+		bitonic_sort16_xf(data, sz, dir, xform, xform);
+		return 0;
+	}
+	
+	uint16_t *adata;
+	uint16_t *scratch = NULL;
+	uint32_t top = 1u << (31 - my_clz32(sz));
+	uint32_t b, pos, tail;
+	
+	if (!is_aligned)
+	{
+		adata = (uint16_t*)aligned_malloc(sz * sizeof(uint16_t), 64);
+		if (adata == NULL)
+			return -1;
+		memcpy(adata, data, sz * sizeof(uint16_t));
+	}
+	else
+	{
+		adata = data;
+	}
+	
+	if (sz > top)
+	{
+		scratch = (uint16_t*)aligned_malloc((sz - top) * sizeof(uint16_t), 64);
+		if (scratch == NULL)
+		{
+			if (!is_aligned)
+				aligned_free(adata);
+			return -1;
+		}
+	}
+	
+	for (b = top, pos = 0; b >= 64; b >>= 1)
+	{
+		if (sz & b)
+		{
+			bitonic_sort16_xf(adata + pos, b, dir, xform, (b == sz) ? xform : XFORM_NONE);
+			pos += b;
+		}
+	}
+	
+	tail = sz - pos;
+	if (tail > 0)
+	{
+		xform16_any(adata + pos, tail, xform);
+		sort_small16_xf(adata + pos, tail, dir, XFORM_NONE);
+	}
+	
+	for (b = 64; b <= top; b <<= 1)
+	{
+		if (sz & b)
+		{
+			pos -= b;
+			if (tail > 0)
+			{
+				merge_backward16(adata + pos, b, tail, scratch, dir);
+			}
+			tail += b;
+		}
+	}
+	
+	if (sz > top)
+	{
+		xform16_any(adata, sz, xform);
+	}
+	
+	if (scratch != NULL)
+	{
+		aligned_free(scratch);
+	}
+	
+	if (!is_aligned)
+	{
+		memcpy(data, adata, sz * sizeof(uint16_t));
+		aligned_free(adata);
+	}
+	
+	return 0;
+}
+
+int sort16(uint16_t *data, uint32_t sz, int dir)
+{
+	// top level 16-bit sort: arbitrary size and alignment,
+	// same contract as sort() and sort32().
+	return sort16_xf(data, sz, dir, XFORM_NONE);
+}
+
+int sorti16(int16_t *data, uint32_t sz, int dir)
+{
+	// signed 16-bit sort, arbitrary size and alignment
+	return sort16_xf((uint16_t *)data, sz, dir, XFORM_SIGNED);
+}
+
+// 8-bit sorts: 64 lanes per vector.  The base cases are written as
+// loops over the stages that the compiler unrolls completely (as for
+// the AVX2 kernels), with SWAP8 .. SWAP256 for the compare distances
+// within a vector.  Descending sorts complement the keys.
+
+// lanes of a vector whose element index has bit j set, for element
+// indices r * 64 .. r * 64 + 63
+#define BIT_LANES8(r, j) (((j) == 1) ? 0xaaaaaaaaaaaaaaaaull : ((j) == 2) ? 0xccccccccccccccccull : \
+	((j) == 4) ? 0xf0f0f0f0f0f0f0f0ull : ((j) == 8) ? 0xff00ff00ff00ff00ull : \
+	((j) == 16) ? 0xffff0000ffff0000ull : ((j) == 32) ? 0xffffffff00000000ull : \
+	(((r) * 64) & (j)) ? 0xffffffffffffffffull : 0ull)
+
+static __inline __attribute__((always_inline)) void bitonic_net8(__m512i *v, int nreg, int lg)
+{
+	// ascending bitonic sort of the 64 * nreg = 2^lg bytes in v
+	int kb, jb, r;
+	
+#pragma GCC unroll 16
+	for (kb = 1; kb <= lg; kb++)
+	{
+#pragma GCC unroll 16
+		for (jb = kb - 1; jb >= 0; jb--)
+		{
+			int k = 1 << kb;
+			int j = 1 << jb;
+			
+			if (j >= 64)
+			{
+				// compare/swap between registers
+#pragma GCC unroll 16
+				for (r = 0; r < nreg; r++)
+				{
+					if ((r & (j / 64)) == 0)
+					{
+						int p = r + j / 64;
+						__m512i mn = _mm512_min_epu8(v[r], v[p]);
+						__m512i mx = _mm512_max_epu8(v[r], v[p]);
+						
+						v[r] = (((r * 64) & k) == 0) ? mn : mx;
+						v[p] = (((r * 64) & k) == 0) ? mx : mn;
+					}
+				}
+			}
+			else
+			{
+				// compare/swap within registers: lanes with bit j set
+				// take the max in ascending blocks (bit k clear)
+#pragma GCC unroll 16
+				for (r = 0; r < nreg; r++)
+				{
+					__m512i sw = (j == 1) ? SWAP8(v[r]) : (j == 2) ? SWAP16(v[r]) :
+						(j == 4) ? SWAP32(v[r]) : (j == 8) ? SWAP64(v[r]) : 
+						(j == 16) ? SWAP128(v[r]) : SWAP256(v[r]);
+					__m512i mn = _mm512_min_epu8(v[r], sw);
+					__m512i mx = _mm512_max_epu8(v[r], sw);
+					
+					v[r] = _mm512_mask_blend_epi8(BIT_LANES8(r, j) ^ BIT_LANES8(r, k), mn, mx);
+				}
+			}
+		}
+	}
+	return;
+}
+
+static __inline __attribute__((always_inline)) void sort8_regs(uint8_t *data, int nreg, int lg, int dir)
+{
+	__m512i v[16];
+	__m512i f = _mm512_set1_epi8(dir ? -1 : 0);
+	int r;
+	
+#pragma GCC unroll 16
+	for (r = 0; r < nreg; r++)
+		v[r] = _mm512_xor_si512(_mm512_loadu_si512(data + 64 * r), f);
+	bitonic_net8(v, nreg, lg);
+#pragma GCC unroll 16
+	for (r = 0; r < nreg; r++)
+		_mm512_storeu_si512(data + 64 * r, _mm512_xor_si512(v[r], f));
+	return;
+}
+
+void bitonic_sort8_dir_64(uint8_t *data, int dir)
+{
+	sort8_regs(data, 1, 6, dir);
+}
+
+void bitonic_sort8_dir_128(uint8_t *data, int dir)
+{
+	sort8_regs(data, 2, 7, dir);
+}
+
+void bitonic_sort8_dir_256(uint8_t *data, int dir)
+{
+	sort8_regs(data, 4, 8, dir);
+}
+
+void bitonic_sort8_dir_512(uint8_t *data, int dir)
+{
+	sort8_regs(data, 8, 9, dir);
+}
+
+void bitonic_sort8_dir_1024(uint8_t *data, int dir)
+{
+	sort8_regs(data, 16, 10, dir);
+}
+
+int sort8(uint8_t *data, size_t sz, int dir)
+{
+	// up to 1024 bytes: the smallest base case that holds sz, with
+	// masked loads into a buffer padded to sort last.  Above that a 
+	// counting sort: its fixed cost (clearing and walking the counts) 
+	// makes it slower than the 1024 base case at that size, but it is
+	// linear from there on.
+	if (sz <= 1024)
+	{
+		__attribute__((aligned(64))) uint8_t buf[1024];
+		__m512i pad = _mm512_set1_epi8(dir ? 0 : -1);
+		uint32_t n = 64, i;
+		
+		while (n < sz)
+			n *= 2;
+		
+		for (i = 0; i < n; i += 64)
+		{
+			__mmask64 m = (sz >= i + 64) ? ~0ull : (sz > i) ? (1ull << (sz - i)) - 1 : 0;
+			_mm512_store_si512(buf + i, _mm512_mask_loadu_epi8(pad, m, data + i));
+		}
+		
+		if (n == 64)
+			bitonic_sort8_dir_64(buf, dir);
+		else if (n == 128)
+			bitonic_sort8_dir_128(buf, dir);
+		else if (n == 256)
+			bitonic_sort8_dir_256(buf, dir);
+		else if (n == 512)
+			bitonic_sort8_dir_512(buf, dir);
+		else
+			bitonic_sort8_dir_1024(buf, dir);
+		
+		for (i = 0; i < sz; i += 64)
+		{
+			__mmask64 m = (sz >= i + 64) ? ~0ull : (1ull << (sz - i)) - 1;
+			_mm512_mask_storeu_epi8(data + i, m, _mm512_load_si512(buf + i));
+		}
+		return 0;
+	}
+	else
+	{
+		// four histograms so that runs of equal bytes don't 
+		// serialize on one counter
+		size_t count[4][256];
+		size_t i, pos = 0;
+		int b;
+		
+		memset(count, 0, sizeof(count));
+		for (i = 0; i + 4 <= sz; i += 4)
+		{
+			count[0][data[i]]++;
+			count[1][data[i + 1]]++;
+			count[2][data[i + 2]]++;
+			count[3][data[i + 3]]++;
+		}
+		for (; i < sz; i++)
+			count[0][data[i]]++;
+		
+		for (b = 0; b < 256; b++)
+		{
+			int v = dir ? 255 - b : b;
+			size_t c = count[0][v] + count[1][v] + count[2][v] + count[3][v];
+			
+			memset(data + pos, v, c);
+			pos += c;
+		}
+		return 0;
+	}
+}
+
+static void xform32(uint32_t *data, uint32_t sz, int xform, int inverse)
+{
+	// sz is a multiple of 16 and data is aligned.
+	// floats: flip all bits of negatives and the sign bit of positives,
+	// which orders -NaN < -inf < ... < -0.0 < +0.0 < ... < +inf < +NaN.
+	// signed: flip the sign bit.
+	__m512i sign = _mm512_set1_epi32(0x80000000);
+	__m512i m = _mm512_setzero_si512();
+	int i;
+
+	if (xform == XFORM_NONE)
+		return;
+
+	for (i = 0; i < sz; i += 16)
+	{
+		__m512i v = _mm512_load_si512(data + i);
+
+		if (xform == XFORM_FLOAT)
+		{
+			if (inverse)
+				m = _mm512_srai_epi32(_mm512_xor_si512(v, sign), 31);
+			else
+				m = _mm512_srai_epi32(v, 31);
+		}
+		v = _mm512_xor_si512(v, _mm512_or_si512(m, sign));
+		_mm512_store_si512(data + i, v);
+	}
+	return;
+}
+
+static uint32_t xform32_pad(int xform, int dir)
+{
+	// see xform64_pad
+	uint32_t k = (dir == 0) ? 0xffffffff : 0;
+	
+	if (xform == XFORM_FLOAT)
+		return k ^ ((uint32_t)((int32_t)(k ^ 0x80000000) >> 31) | 0x80000000);
+	else if (xform == XFORM_SIGNED)
+		return k ^ 0x80000000;
+	return k;
+}
+
+static void bitonic_merge32_pass(uint32_t *data, uint32_t sz, int dir, uint32_t start, uint32_t stop)
+{
+	// half-size cmp/swap of bitonic_merge32, for the
+	// 256-element batches start to stop - 1 of sz / 256.
 	int i;
 
 	// we have sz/2 swaps to do at a stride of sz/2.
@@ -6031,7 +7170,7 @@ void bitonic_merge32(uint32_t *data, uint32_t sz, int dir)
 	if (dir == 1)
 	{
 		// 256-element merge passes at a stride of sz/2
-		for (i = 0; i < sz / 256; i++)
+		for (i = start; i < stop; i++)
 		{
 			// swap 128 elements at starting offset i * 128
 			dv1 = _mm512_load_epi32(data + i * 128 +  0);
@@ -6164,7 +7303,7 @@ void bitonic_merge32(uint32_t *data, uint32_t sz, int dir)
 	else
 	{
 		// 256-element merge passes at a stride of sz/2
-		for (i = 0; i < sz / 256; i++)
+		for (i = start; i < stop; i++)
 		{
 			// swap 128 elements at starting offset i * 128
 			dv1 = _mm512_load_epi32(data + i * 128 +  0);
@@ -6294,140 +7433,3893 @@ void bitonic_merge32(uint32_t *data, uint32_t sz, int dir)
 
 		}
 	}
-
-	// two parallel half-size merges
-	bitonic_merge32(data, sz / 2, dir);
-	bitonic_merge32(data + sz / 2, sz / 2, dir);
 }
 
-void bitonic_sort32(uint32_t *data, uint32_t sz, int dir)
+static void bitonic_merge32_xf(uint32_t *data, uint32_t sz, int dir, int xout)
+{
+	if (sz <= 64)
+	{
+		// base case: do the hardcoded 64-element sort
+		bitonic_merge32_dir_64(data, dir);
+		xform32(data, sz, xout, 1);
+		return;
+	}
+	else if (sz <= 128)
+	{
+		// base case: do the hardcoded 128-element sort
+		bitonic_merge32_dir_128(data, dir);
+		xform32(data, sz, xout, 1);
+		return;
+	}
+	
+	bitonic_merge32_pass(data, sz, dir, 0, sz / 256);
+
+	// two parallel half-size merges
+	bitonic_merge32_xf(data, sz / 2, dir, xout);
+	bitonic_merge32_xf(data + sz / 2, sz / 2, dir, xout);
+}
+
+void bitonic_merge32(uint32_t *data, uint32_t sz, int dir)
+{
+	bitonic_merge32_xf(data, sz, dir, XFORM_NONE);
+}
+
+static void bitonic_sort32_xf(uint32_t *data, uint32_t sz, int dir, int xin, int xout)
+{
+	// xin is applied to the input of the base case sorts and
+	// xout to the output of the final merge.
+	if (sz <= 256)
+	{
+		xform32(data, sz, xin, 0);
+		
+		if (sz == 64)
+		{
+			// base case: do the hardcoded 64-element sort
+			bitonic_sort32_dir_64(data, dir);
+		}
+		else if (sz == 128)
+		{
+			// base case: do the hardcoded 128-element sort
+			bitonic_sort32_dir_128(data, dir);
+		}
+		else
+		{
+			// base case: do the hardcoded 256-element sort
+			bitonic_sort32_dir_256(data, dir);
+		}
+		
+		xform32(data, sz, xout, 1);
+		return;
+	}
+
+	// two half-size bitonic sorts,
+	// with opposite directions.
+	bitonic_sort32_xf(data, sz / 2, 0, xin, XFORM_NONE);
+	bitonic_sort32_xf(data + sz / 2, sz / 2, 1, xin, XFORM_NONE);
+
+	// merge in the specified direction
+	bitonic_merge32_xf(data, sz, dir, xout);
+
+	return;
+}
+
+void bitonic_sort32(uint32_t *data, uint32_t sz, int dir)
+{
+	bitonic_sort32_xf(data, sz, dir, XFORM_NONE, XFORM_NONE);
+}
+
+static __inline void merge16x16_32(__m512i *a, __m512i *b, __mmask16 d)
+{
+	// 32-bit version of merge8x8_64, d = 0 or 0xffff
+	__m512i rev = _mm512_setr_epi32(15, 14, 13, 12, 11, 10, 9, 8, 
+		7, 6, 5, 4, 3, 2, 1, 0);
+	__m512i x = *a;
+	__m512i y = _mm512_permutexvar_epi32(rev, *b);
+	__m512i mn = _mm512_min_epu32(x, y);
+	__m512i mx = _mm512_max_epu32(x, y);
+	__m512i s1, s2;
+	
+	x = _mm512_mask_blend_epi32(d, mn, mx);
+	y = _mm512_mask_blend_epi32(d, mx, mn);
+	
+	s1 = SWAP256(x);
+	s2 = SWAP256(y);
+	x = _mm512_mask_blend_epi32(0xFF00 ^ d, _mm512_min_epu32(x, s1), _mm512_max_epu32(x, s1));
+	y = _mm512_mask_blend_epi32(0xFF00 ^ d, _mm512_min_epu32(y, s2), _mm512_max_epu32(y, s2));
+	
+	s1 = SWAP128(x);
+	s2 = SWAP128(y);
+	x = _mm512_mask_blend_epi32(0xF0F0 ^ d, _mm512_min_epu32(x, s1), _mm512_max_epu32(x, s1));
+	y = _mm512_mask_blend_epi32(0xF0F0 ^ d, _mm512_min_epu32(y, s2), _mm512_max_epu32(y, s2));
+	
+	s1 = SWAP64(x);
+	s2 = SWAP64(y);
+	x = _mm512_mask_blend_epi32(0xCCCC ^ d, _mm512_min_epu32(x, s1), _mm512_max_epu32(x, s1));
+	y = _mm512_mask_blend_epi32(0xCCCC ^ d, _mm512_min_epu32(y, s2), _mm512_max_epu32(y, s2));
+	
+	s1 = SWAP32(x);
+	s2 = SWAP32(y);
+	x = _mm512_mask_blend_epi32(0xAAAA ^ d, _mm512_min_epu32(x, s1), _mm512_max_epu32(x, s1));
+	y = _mm512_mask_blend_epi32(0xAAAA ^ d, _mm512_min_epu32(y, s2), _mm512_max_epu32(y, s2));
+	
+	*a = x;
+	*b = y;
+	return;
+}
+
+static void merge_backward32(uint32_t *data, uint32_t nl, uint32_t nr, uint32_t *scratch, int dir)
+{
+	// 32-bit version of merge_backward64, 16 at a time
+	__attribute__((aligned(64))) uint32_t carry[16];
+	__mmask16 d = (dir == 0) ? 0 : 0xffff;
+	uint32_t *L = data;
+	uint32_t *R = scratch;
+	uint32_t o = nl + nr;
+	uint32_t nc = 0;
+	
+	memcpy(R, data + nl, nr * sizeof(uint32_t));
+	
+	if ((nl >= 16) && (nr >= 16))
+	{
+		__m512i c;
+		__m512i v;
+		
+		nl -= 16;
+		nr -= 16;
+		c = _mm512_loadu_si512(L + nl);
+		v = _mm512_loadu_si512(R + nr);
+		merge16x16_32(&c, &v, d);
+		o -= 16;
+		_mm512_storeu_si512(data + o, v);
+		
+		while ((nl >= 16) && (nr >= 16))
+		{
+			if (AFTER(L[nl - 1], R[nr - 1], dir))
+			{
+				nl -= 16;
+				v = _mm512_loadu_si512(L + nl);
+			}
+			else
+			{
+				nr -= 16;
+				v = _mm512_loadu_si512(R + nr);
+			}
+			merge16x16_32(&c, &v, d);
+			o -= 16;
+			_mm512_storeu_si512(data + o, v);
+		}
+		
+		_mm512_store_si512(carry, c);
+		nc = 16;
+	}
+	
+	while ((nr + nc) > 0)
+	{
+		uint32_t v;
+		
+		if ((nl == 0) && (nc == 0))
+		{
+			memcpy(data, R, nr * sizeof(uint32_t));
+			break;
+		}
+		
+		if ((nl > 0) && 
+			((nr == 0) || !AFTER(R[nr - 1], L[nl - 1], dir)) &&
+			((nc == 0) || !AFTER(carry[nc - 1], L[nl - 1], dir)))
+		{
+			v = L[--nl];
+		}
+		else if ((nr > 0) && ((nc == 0) || !AFTER(carry[nc - 1], R[nr - 1], dir)))
+		{
+			v = R[--nr];
+		}
+		else
+		{
+			v = carry[--nc];
+		}
+		data[--o] = v;
+	}
+	
+	return;
+}
+
+static void merge_forward32(uint32_t *out, uint32_t *a, size_t na, uint32_t *b, size_t nb, int dir)
+{
+	// 32-bit version of merge_forward64, 16 at a time
+	__attribute__((aligned(64))) uint32_t carry[16];
+	uint32_t small[32];
+	__mmask16 d = (dir == 0) ? 0 : 0xffff;
+	size_t ia = 0, ib = 0, o = 0, nc = 0, ns = 0, ic = 0, ir = 0, k = 0;
+	size_t nr, nbig, s;
+	uint32_t *r, *big;
+	
+	if ((na >= 16) && (nb >= 16))
+	{
+		__m512i v = _mm512_loadu_si512(a);
+		__m512i c = _mm512_loadu_si512(b);
+		
+		ia = 16;
+		ib = 16;
+		merge16x16_32(&v, &c, d);
+		_mm512_storeu_si512(out, v);
+		o = 16;
+		
+		while ((ia + 16 <= na) && (ib + 16 <= nb))
+		{
+			if (AFTER(a[ia], b[ib], dir))
+			{
+				v = _mm512_loadu_si512(b + ib);
+				ib += 16;
+			}
+			else
+			{
+				v = _mm512_loadu_si512(a + ia);
+				ia += 16;
+			}
+			merge16x16_32(&v, &c, d);
+			_mm512_storeu_si512(out + o, v);
+			o += 16;
+		}
+		
+		_mm512_store_si512(carry, c);
+		nc = 16;
+	}
+	
+	if ((na - ia) <= (nb - ib))
+	{
+		r = a + ia;
+		nr = na - ia;
+		big = b + ib;
+		nbig = nb - ib;
+	}
+	else
+	{
+		r = b + ib;
+		nr = nb - ib;
+		big = a + ia;
+		nbig = na - ia;
+	}
+	
+	while ((ic < nc) || (ir < nr))
+	{
+		if ((ir == nr) || ((ic < nc) && !AFTER(carry[ic], r[ir], dir)))
+			small[ns++] = carry[ic++];
+		else
+			small[ns++] = r[ir++];
+	}
+	
+	for (s = 0; s < ns; s++)
+	{
+		size_t lo = k, hi = nbig;
+		
+		// first element of the long remainder that sorts after small[s]
+		while (lo < hi)
+		{
+			size_t mid = lo + (hi - lo) / 2;
+			if (AFTER(big[mid], small[s], dir))
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		
+		memcpy(out + o, big + k, (lo - k) * sizeof(uint32_t));
+		o += lo - k;
+		k = lo;
+		out[o++] = small[s];
+	}
+	memcpy(out + o, big + k, (nbig - k) * sizeof(uint32_t));
+	
+	return;
+}
+
+static void sort_small32_xf(uint32_t *data, uint32_t sz, int dir, int xform)
+{
+	// sz <= 256, any alignment: as sort_small64_xf, using the
+	// smallest base case that holds sz.
+	__attribute__((aligned(64))) uint32_t buf[256];
+	__m512i pad = _mm512_set1_epi32(xform32_pad(xform, dir));
+	uint32_t i, n = 64;
+	
+	while (n < sz)
+		n *= 2;
+	
+	for (i = 0; i < n; i += 16)
+	{
+		__mmask16 m = (sz >= i + 16) ? 0xffff : (sz > i) ? (1 << (sz - i)) - 1 : 0;
+		_mm512_store_si512(buf + i, _mm512_mask_loadu_epi32(pad, m, data + i));
+	}
+	
+	xform32(buf, n, xform, 0);
+	if (n == 64)
+		bitonic_sort32_dir_64(buf, dir);
+	else if (n == 128)
+		bitonic_sort32_dir_128(buf, dir);
+	else
+		bitonic_sort32_dir_256(buf, dir);
+	xform32(buf, n, xform, 1);
+	
+	for (i = 0; i < sz; i += 16)
+	{
+		__mmask16 m = (sz >= i + 16) ? 0xffff : (1 << (sz - i)) - 1;
+		_mm512_mask_storeu_epi32(data + i, m, _mm512_load_si512(buf + i));
+	}
+	return;
+}
+
+void bitonic_sort32_dir_256_masked(uint32_t *data, uint32_t sz, int dir)
+{
+	// unaligned and/or partially filled (sz <= 256) entry point 
+	// to the 32-bit base cases.  sorts in place, no heap.
+	sort_small32_xf(data, sz, dir, XFORM_NONE);
+}
+
+static void merge_head32(uint32_t *data, uint32_t h, uint32_t sz, int dir)
+{
+	// 32-bit version of merge_head64, h <= 16
+	uint32_t head[16];
+	uint32_t *R = data + h;
+	uint32_t i, o = 0, r = 0;
+	
+	memcpy(head, data, h * sizeof(uint32_t));
+	
+	for (i = 0; i < h; i++)
+	{
+		uint32_t lo = r, hi = sz;
+		
+		while (lo < hi)
+		{
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (AFTER(R[mid], head[i], dir))
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		
+		memmove(data + o, R + r, (lo - r) * sizeof(uint32_t));
+		o += lo - r;
+		r = lo;
+		data[o++] = head[i];
+	}
+	
+	return;
+}
+
+static void xform32_any(uint32_t *data, uint32_t sz, int xform, int inverse)
+{
+	// see xform64_any
+	__attribute__((aligned(64))) uint32_t buf[16];
+	uint32_t n = sz & ~15u;
+	uint32_t i;
+	
+	if (xform == XFORM_NONE)
+		return;
+	
+	for (i = 0; i < n; i += 4096)
+		xform32(data + i, ((n - i) < 4096) ? (n - i) : 4096, xform, inverse);
+	
+	if (sz > n)
+	{
+		memcpy(buf, data + n, (sz - n) * sizeof(uint32_t));
+		xform32(buf, 16, xform, inverse);
+		memcpy(data + n, buf, (sz - n) * sizeof(uint32_t));
+	}
+	return;
+}
+
+static int sort32_xf(uint32_t *data, uint32_t sz, int dir, int xform)
+{
+	// top level 32-bit sort, same approach as sort_xf()
+	int is_aligned = (((uint64_t)data & 0x3full) == 0);
+	
+	if (sz <= 256)
+	{
+		sort_small32_xf(data, sz, dir, xform);
+		return 0;
+	}
+	
+	if (is_aligned && ((sz & (sz - 1)) == 0))
+	{
+		// meets both requirements as-is
+		bitonic_sort32_xf(data, sz, dir, xform, xform);
+		return 0;
+	}
+	
+	if (!is_aligned && (xform == XFORM_NONE) && (((uint64_t)data & 0x3ull) == 0))
+	{
+		// in-place head + aligned rest, see sort_xf()
+		uint32_t h = (64 - ((uint64_t)data & 0x3full)) / sizeof(uint32_t);
+		
+		sort_small32_xf(data, h, dir, XFORM_NONE);
+		if (sort32_xf(data + h, sz - h, dir, XFORM_NONE) != 0)
+			return -1;
+		merge_head32(data, h, sz - h, dir);
+		return 0;
+	}
+	
+	uint32_t *adata;
+	uint32_t *scratch = NULL;
+	uint32_t top = 1u << (31 - my_clz32(sz));
+	uint32_t b, pos, tail;
+	
+	if (!is_aligned)
+	{
+		adata = (uint32_t*)aligned_malloc(sz * sizeof(uint32_t), 64);
+		if (adata == NULL)
+			return -1;
+		memcpy(adata, data, sz * sizeof(uint32_t));
+	}
+	else
+	{
+		adata = data;
+	}
+	
+	if (sz > top)
+	{
+		scratch = (uint32_t*)aligned_malloc((sz - top) * sizeof(uint32_t), 64);
+		if (scratch == NULL)
+		{
+			if (!is_aligned)
+				aligned_free(adata);
+			return -1;
+		}
+	}
+	
+	for (b = top, pos = 0; b >= 64; b >>= 1)
+	{
+		if (sz & b)
+		{
+			bitonic_sort32_xf(adata + pos, b, dir, xform, (b == sz) ? xform : XFORM_NONE);
+			pos += b;
+		}
+	}
+	
+	tail = sz - pos;
+	if (tail > 0)
+	{
+		xform32_any(adata + pos, tail, xform, 0);
+		sort_small32_xf(adata + pos, tail, dir, XFORM_NONE);
+	}
+	
+	for (b = 64; b <= top; b <<= 1)
+	{
+		if (sz & b)
+		{
+			pos -= b;
+			if (tail > 0)
+			{
+				merge_backward32(adata + pos, b, tail, scratch, dir);
+			}
+			tail += b;
+		}
+	}
+	
+	if (sz > top)
+	{
+		xform32_any(adata, sz, xform, 1);
+	}
+	
+	if (scratch != NULL)
+	{
+		aligned_free(scratch);
+	}
+	
+	if (!is_aligned)
+	{
+		memcpy(data, adata, sz * sizeof(uint32_t));
+		aligned_free(adata);
+	}
+	
+	return 0;
+}
+
+static int sort32_avx512(uint32_t *data, uint32_t sz, int dir)
+{
+	return sort32_xf(data, sz, dir, XFORM_NONE);
+}
+
+int sortf32(float *data, uint32_t sz, int dir)
+{
+	// sort 32-bit IEEE floats.  Orders 
+	// -NaN < -inf < ... < -0.0 < +0.0 < ... < +inf < +NaN
+	// (reversed for dir == 1).
+	return sort32_xf((uint32_t *)data, sz, dir, XFORM_FLOAT);
+}
+
+int sorti32(int32_t *data, uint32_t sz, int dir)
+{
+	// signed 32-bit sort, arbitrary size and alignment
+	return sort32_xf((uint32_t *)data, sz, dir, XFORM_SIGNED);
+}
+
+// hybrid sorts: quicksort with vectorized in-place partitioning down 
+// to base case sized pieces.  Unlike the bitonic sorts these depend 
+// on the data, so presorted input costs less than random input.  A 
+// depth limit hands badly partitioned ranges to the bitonic sorts.
+static __inline __attribute__((always_inline)) size_t partition64(uint64_t *data, 
+	size_t n, uint64_t pivot, int dir, int incl)
+{
+	// move the elements that sort before pivot (incl: or equal 
+	// to it) to the front and return their count, n >= 16.  The 
+	// first and last vectors are held in registers to open a gap
+	// at each end; each step reads a vector from the end with the 
+	// smaller gap and compresses its two halves into the gaps.
+	__m512i f = _mm512_set1_epi64(dir ? -1LL : 0);
+	__m512i p = _mm512_xor_si512(_mm512_set1_epi64(pivot), f);
+	__m512i vl = _mm512_loadu_si512(data);
+	__m512i vr = _mm512_loadu_si512(data + n - 8);
+	size_t l = 8, r = n - 8, wl = 0, wr = n;
+	__m512i v;
+	__mmask8 m, t;
+	int c;
+	
+#define PART64_STEP(v, t) \
+	m = incl ? _mm512_mask_cmple_epu64_mask(t, _mm512_xor_si512(v, f), p) : \
+		_mm512_mask_cmplt_epu64_mask(t, _mm512_xor_si512(v, f), p); \
+	c = _mm_popcnt_u32(m); \
+	_mm512_mask_compressstoreu_epi64(data + wl, m, v); \
+	wl += c; \
+	wr -= _mm_popcnt_u32(t) - c; \
+	_mm512_mask_compressstoreu_epi64(data + wr, t & ~m, v);
+	
+	while (r - l >= 8)
+	{
+		if ((l - wl) <= (wr - r))
+		{
+			v = _mm512_loadu_si512(data + l);
+			l += 8;
+		}
+		else
+		{
+			r -= 8;
+			v = _mm512_loadu_si512(data + r);
+		}
+		PART64_STEP(v, 0xff);
+	}
+	
+	t = (1 << (r - l)) - 1;
+	v = _mm512_maskz_loadu_epi64(t, data + l);
+	PART64_STEP(v, t);
+	PART64_STEP(vl, 0xff);
+	PART64_STEP(vr, 0xff);
+#undef PART64_STEP
+	
+	return wl;
+}
+
+static int qsort_rec64(uint64_t *data, size_t n, int dir, int depth)
+{
+	__attribute__((aligned(64))) uint64_t smp[64];
+	uint64_t pivot;
+	size_t nl, i;
+	
+	while (n > 64)
+	{
+		if (depth-- == 0)
+			return sort_avx512(data, n, dir);
+		
+		// median of 64 evenly spaced samples
+		for (i = 0; i < 64; i++)
+			smp[i] = data[i * (n / 64)];
+		bitonic_sort_dir_64(smp, dir);
+		pivot = smp[32];
+		
+		nl = partition64(data, n, pivot, dir, 0);
+		if (nl == 0)
+		{
+			// nothing sorts before the pivot: peel off its copies, 
+			// which are already in their final place.
+			nl = partition64(data, n, pivot, dir, 1);
+			data += nl;
+			n -= nl;
+			continue;
+		}
+		
+		// recurse into the smaller side, loop on the larger
+		if (nl < n - nl)
+		{
+			if (qsort_rec64(data, nl, dir, depth) != 0)
+				return -1;
+			data += nl;
+			n -= nl;
+		}
+		else
+		{
+			if (qsort_rec64(data + nl, n - nl, dir, depth) != 0)
+				return -1;
+			n = nl;
+		}
+	}
+	
+	sort_small64_xf(data, n, dir, XFORM_NONE);
+	return 0;
+}
+
+int sort_hybrid(uint64_t *data, size_t sz, int dir)
+{
+	// in-place hybrid quicksort, arbitrary size and alignment.  
+	// Pieces of up to 64 elements are finished with bitonic_sort_dir_64.
+	return qsort_rec64(data, sz, dir, 2 * (64 - my_clz64(sz | 1)));
+}
+
+static __inline __attribute__((always_inline)) uint32_t partition32(uint32_t *data, 
+	uint32_t n, uint32_t pivot, int dir, int incl)
+{
+	// 32-bit version of partition64, n >= 32
+	__m512i f = _mm512_set1_epi32(dir ? -1 : 0);
+	__m512i p = _mm512_xor_si512(_mm512_set1_epi32(pivot), f);
+	__m512i vl = _mm512_loadu_si512(data);
+	__m512i vr = _mm512_loadu_si512(data + n - 16);
+	uint32_t l = 16, r = n - 16, wl = 0, wr = n;
+	__m512i v;
+	__mmask16 m, t;
+	int c;
+	
+#define PART32_STEP(v, t) \
+	m = incl ? _mm512_mask_cmple_epu32_mask(t, _mm512_xor_si512(v, f), p) : \
+		_mm512_mask_cmplt_epu32_mask(t, _mm512_xor_si512(v, f), p); \
+	c = _mm_popcnt_u32(m); \
+	_mm512_mask_compressstoreu_epi32(data + wl, m, v); \
+	wl += c; \
+	wr -= _mm_popcnt_u32(t) - c; \
+	_mm512_mask_compressstoreu_epi32(data + wr, t & ~m, v);
+	
+	while (r - l >= 16)
+	{
+		if ((l - wl) <= (wr - r))
+		{
+			v = _mm512_loadu_si512(data + l);
+			l += 16;
+		}
+		else
+		{
+			r -= 16;
+			v = _mm512_loadu_si512(data + r);
+		}
+		PART32_STEP(v, 0xffff);
+	}
+	
+	t = (1 << (r - l)) - 1;
+	v = _mm512_maskz_loadu_epi32(t, data + l);
+	PART32_STEP(v, t);
+	PART32_STEP(vl, 0xffff);
+	PART32_STEP(vr, 0xffff);
+#undef PART32_STEP
+	
+	return wl;
+}
+
+static int qsort_rec32(uint32_t *data, uint32_t n, int dir, int depth)
+{
+	// see qsort_rec64
+	__attribute__((aligned(64))) uint32_t smp[64];
+	uint32_t pivot, nl, i;
+	
+	while (n > 256)
+	{
+		if (depth-- == 0)
+			return sort32_avx512(data, n, dir);
+		
+		for (i = 0; i < 64; i++)
+			smp[i] = data[i * (n / 64)];
+		bitonic_sort32_dir_64(smp, dir);
+		pivot = smp[32];
+		
+		nl = partition32(data, n, pivot, dir, 0);
+		if (nl == 0)
+		{
+			nl = partition32(data, n, pivot, dir, 1);
+			data += nl;
+			n -= nl;
+			continue;
+		}
+		
+		if (nl < n - nl)
+		{
+			if (qsort_rec32(data, nl, dir, depth) != 0)
+				return -1;
+			data += nl;
+			n -= nl;
+		}
+		else
+		{
+			if (qsort_rec32(data + nl, n - nl, dir, depth) != 0)
+				return -1;
+			n = nl;
+		}
+	}
+	
+	sort_small32_xf(data, n, dir, XFORM_NONE);
+	return 0;
+}
+
+int sort_hybrid32(uint32_t *data, uint32_t sz, int dir)
+{
+	// 32-bit version of sort_hybrid.  Pieces of up to 256 
+	// elements are finished with bitonic_sort32_dir_64/128/256.
+	return qsort_rec32(data, sz, dir, 2 * (32 - my_clz32(sz | 1)));
+}
+
+// MSD radix sorts for arrays larger than L2: 8-bit digits from the 
+// highest bit at which the keys differ, scattered back and forth 
+// between data and a scratch array.  A bucket stops being split when 
+// it fits a base case (sort_small*_xf) or, up to RADIX_LEAF, is small
+// enough for the hybrid quicksort to finish in cache.
+// The histograms are scalar, four sub-counts as in sort8: a 
+// conflict/gather/scatter vector histogram (vpconflictd) measured 
+// the same on random digits and 40% slower when most keys share a 
+// digit, and extracting the digits with vector shifts into a buffer
+// for scalar counts was 3x slower.  Only the bit range scan is vector.
+#define RADIX_LEAF 4096
+
+// sort() and sort32() switch to the radix sorts at these sizes
+#define RADIX_MIN (1 << 21)
+#define RADIX_MIN32 (1 << 22)
+
+static int radix_rec64(uint64_t *a, uint64_t *b, size_t n, int shift, int dir, int in_a)
+{
+	// sort the n elements of a, which agree above bit shift + 7,
+	// leaving the result in a (in_a) or in b.  Returns -1 only if
+	// a quicksort leaf falls back to sort() and that fails.
+	size_t count[4][256];
+	size_t off[256];
+	int flip = dir ? 0xff : 0;
+	size_t i, pos;
+	int d;
+	
+	for (;;)
+	{
+		memset(count, 0, sizeof(count));
+		for (i = 0; i + 4 <= n; i += 4)
+		{
+			count[0][((a[i] >> shift) & 0xff) ^ flip]++;
+			count[1][((a[i + 1] >> shift) & 0xff) ^ flip]++;
+			count[2][((a[i + 2] >> shift) & 0xff) ^ flip]++;
+			count[3][((a[i + 3] >> shift) & 0xff) ^ flip]++;
+		}
+		for (; i < n; i++)
+			count[0][((a[i] >> shift) & 0xff) ^ flip]++;
+		
+		for (d = 0, pos = 0; d < 256; d++)
+		{
+			off[d] = pos;
+			pos += count[0][d] + count[1][d] + count[2][d] + count[3][d];
+			if (pos - off[d] == n)
+				break;
+		}
+		
+		if (d == 256)
+			break;
+		
+		// all in one bucket: go to the next digit without a scatter
+		if (shift == 0)
+		{
+			if (!in_a)
+				memcpy(b, a, n * sizeof(uint64_t));
+			return 0;
+		}
+		shift = (shift >= 8) ? shift - 8 : 0;
+	}
+	
+	for (i = 0; i < n; i++)
+	{
+		uint64_t x = a[i];
+		b[off[((x >> shift) & 0xff) ^ flip]++] = x;
+	}
+	
+	// off[d] is now the end of bucket d
+	for (d = 0, pos = 0; d < 256; d++)
+	{
+		size_t c = off[d] - pos;
+		uint64_t *dst = in_a ? a + pos : b + pos;
+		
+		if ((c <= RADIX_LEAF) || (shift == 0))
+		{
+			if (in_a)
+				memcpy(dst, b + pos, c * sizeof(uint64_t));
+			if ((c <= 64) && (shift > 0))
+				sort_small64_xf(dst, c, dir, XFORM_NONE);
+			else if ((shift > 0) && (qsort_rec64(dst, c, dir, 2 * (64 - my_clz64(c))) != 0))
+				return -1;
+		}
+		else if (radix_rec64(b + pos, a + pos, c, (shift >= 8) ? shift - 8 : 0, dir, !in_a) != 0)
+		{
+			return -1;
+		}
+		pos = off[d];
+	}
+	
+	return 0;
+}
+
+int radix_sort(uint64_t *data, size_t sz, int dir)
+{
+	// MSD radix sort, arbitrary size and alignment.  Needs a 
+	// scratch array of sz elements.
+	__m512i vor = _mm512_setzero_si512();
+	__m512i vand = _mm512_set1_epi64(-1LL);
+	uint64_t *tmp, diff;
+	size_t i;
+	int top, ret;
+	
+	if (sz <= RADIX_LEAF)
+		return sort_hybrid(data, sz, dir);
+	
+	// bits that differ somewhere in data
+	for (i = 0; i + 8 <= sz; i += 8)
+	{
+		__m512i v = _mm512_loadu_si512(data + i);
+		vor = _mm512_or_si512(vor, v);
+		vand = _mm512_and_si512(vand, v);
+	}
+	diff = _mm512_reduce_or_epi64(vor) ^ _mm512_reduce_and_epi64(vand);
+	for (; i < sz; i++)
+		diff |= data[i] ^ data[0];
+	if (diff == 0)
+		return 0;
+	
+	tmp = (uint64_t*)aligned_malloc(sz * sizeof(uint64_t), 64);
+	if (tmp == NULL)
+		return -1;
+	
+	top = 63 - my_clz64(diff);
+	ret = radix_rec64(data, tmp, sz, (top >= 8) ? top - 7 : 0, dir, 1);
+	
+	aligned_free(tmp);
+	return ret;
+}
+
+static int radix_rec32(uint32_t *a, uint32_t *b, uint32_t n, int shift, int dir, int in_a)
+{
+	// 32-bit version of radix_rec64
+	uint32_t count[4][256];
+	uint32_t off[256];
+	int flip = dir ? 0xff : 0;
+	uint32_t i, pos;
+	int d;
+	
+	for (;;)
+	{
+		memset(count, 0, sizeof(count));
+		for (i = 0; i + 4 <= n; i += 4)
+		{
+			count[0][((a[i] >> shift) & 0xff) ^ flip]++;
+			count[1][((a[i + 1] >> shift) & 0xff) ^ flip]++;
+			count[2][((a[i + 2] >> shift) & 0xff) ^ flip]++;
+			count[3][((a[i + 3] >> shift) & 0xff) ^ flip]++;
+		}
+		for (; i < n; i++)
+			count[0][((a[i] >> shift) & 0xff) ^ flip]++;
+		
+		for (d = 0, pos = 0; d < 256; d++)
+		{
+			off[d] = pos;
+			pos += count[0][d] + count[1][d] + count[2][d] + count[3][d];
+			if (pos - off[d] == n)
+				break;
+		}
+		
+		if (d == 256)
+			break;
+		
+		// all in one bucket: go to the next digit without a scatter
+		if (shift == 0)
+		{
+			if (!in_a)
+				memcpy(b, a, n * sizeof(uint32_t));
+			return 0;
+		}
+		shift = (shift >= 8) ? shift - 8 : 0;
+	}
+	
+	for (i = 0; i < n; i++)
+	{
+		uint32_t x = a[i];
+		b[off[((x >> shift) & 0xff) ^ flip]++] = x;
+	}
+	
+	// off[d] is now the end of bucket d
+	for (d = 0, pos = 0; d < 256; d++)
+	{
+		uint32_t c = off[d] - pos;
+		uint32_t *dst = in_a ? a + pos : b + pos;
+		
+		if ((c <= RADIX_LEAF) || (shift == 0))
+		{
+			if (in_a)
+				memcpy(dst, b + pos, c * sizeof(uint32_t));
+			if ((c <= 256) && (shift > 0))
+				sort_small32_xf(dst, c, dir, XFORM_NONE);
+			else if ((shift > 0) && (qsort_rec32(dst, c, dir, 2 * (32 - my_clz32(c))) != 0))
+				return -1;
+		}
+		else if (radix_rec32(b + pos, a + pos, c, (shift >= 8) ? shift - 8 : 0, dir, !in_a) != 0)
+		{
+			return -1;
+		}
+		pos = off[d];
+	}
+	
+	return 0;
+}
+
+int radix_sort32(uint32_t *data, uint32_t sz, int dir)
+{
+	// 32-bit version of radix_sort
+	__m512i vor = _mm512_setzero_si512();
+	__m512i vand = _mm512_set1_epi32(-1);
+	uint32_t *tmp, diff;
+	uint32_t i;
+	int top, ret;
+	
+	if (sz <= RADIX_LEAF)
+		return sort_hybrid32(data, sz, dir);
+	
+	// bits that differ somewhere in data
+	for (i = 0; i + 16 <= sz; i += 16)
+	{
+		__m512i v = _mm512_loadu_si512(data + i);
+		vor = _mm512_or_si512(vor, v);
+		vand = _mm512_and_si512(vand, v);
+	}
+	diff = _mm512_reduce_or_epi32(vor) ^ _mm512_reduce_and_epi32(vand);
+	for (; i < sz; i++)
+		diff |= data[i] ^ data[0];
+	if (diff == 0)
+		return 0;
+	
+	tmp = (uint32_t*)aligned_malloc(sz * sizeof(uint32_t), 64);
+	if (tmp == NULL)
+		return -1;
+	
+	top = 31 - my_clz32(diff);
+	ret = radix_rec32(data, tmp, sz, (top >= 8) ? top - 7 : 0, dir, 1);
+	
+	aligned_free(tmp);
+	return ret;
+}
+
+// adaptive mode (sort_set_adaptive): a pre-scan of the neighbor 
+// compares finds up to ADAPT_RUNS sorted runs.  Sorted input is left 
+// alone, input sorted the other way is reversed and a few runs are 
+// merged, smallest neighboring pair first, instead of being sorted.
+#define ADAPT_RUNS 16
+
+static size_t scan_runs64(uint64_t *data, size_t sz, int dir, size_t *brk, int *fwd)
+{
+	// return the number of places where data is out of order for
+	// dir, the first ADAPT_RUNS - 1 of which go in brk[] as the start
+	// of the next run.  *fwd is set if any neighbors are in strictly
+	// sorted order.  Stops early once both rule out the fast paths.
+	__m512i f = _mm512_set1_epi64(dir ? -1LL : 0);
+	size_t i, nb = 0;
+	
+	*fwd = 0;
+	for (i = 0; i + 9 <= sz; i += 8)
+	{
+		__m512i a = _mm512_xor_si512(_mm512_loadu_si512(data + i), f);
+		__m512i b = _mm512_xor_si512(_mm512_loadu_si512(data + i + 1), f);
+		__mmask8 m = _mm512_cmpgt_epu64_mask(a, b);
+		
+		*fwd |= (_mm512_cmplt_epu64_mask(a, b) != 0);
+		while (m)
+		{
+			if (nb < ADAPT_RUNS - 1)
+				brk[nb] = i + _tzcnt_u32(m) + 1;
+			nb++;
+			m &= m - 1;
+		}
+		if ((nb >= ADAPT_RUNS) && *fwd)
+			return nb;
+	}
+	
+	for (; i + 1 < sz; i++)
+	{
+		if (AFTER(data[i], data[i + 1], dir))
+		{
+			if (nb < ADAPT_RUNS - 1)
+				brk[nb] = i + 1;
+			nb++;
+		}
+		else if (data[i] != data[i + 1])
+		{
+			*fwd = 1;
+		}
+	}
+	return nb;
+}
+
+static void reverse64(uint64_t *data, size_t sz)
+{
+	__m512i rev = _mm512_set_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+	size_t i = 0, j = sz;
+	
+	while (j - i >= 16)
+	{
+		__m512i a = _mm512_loadu_si512(data + i);
+		__m512i b = _mm512_loadu_si512(data + j - 8);
+		
+		_mm512_storeu_si512(data + i, _mm512_permutexvar_epi64(rev, b));
+		_mm512_storeu_si512(data + j - 8, _mm512_permutexvar_epi64(rev, a));
+		i += 8;
+		j -= 8;
+	}
+	
+	for (; j - i >= 2; i++, j--)
+	{
+		uint64_t t = data[i];
+		data[i] = data[j - 1];
+		data[j - 1] = t;
+	}
+	return;
+}
+
+static int sort_adaptive64(uint64_t *data, size_t sz, int dir, int *done)
+{
+	// try the presorted fast paths.  *done is cleared if 
+	// none apply and data still needs to be sorted.
+	size_t run[ADAPT_RUNS + 1];
+	size_t nb;
+	uint64_t *scratch;
+	int fwd, nr, i, best;
+	
+	*done = 1;
+	nb = scan_runs64(data, sz, dir, run + 1, &fwd);
+	
+	if (nb == 0)
+		return 0;
+	
+	if (!fwd)
+	{
+		reverse64(data, sz);
+		return 0;
+	}
+	
+	if (nb >= ADAPT_RUNS)
+	{
+		*done = 0;
+		return 0;
+	}
+	
+	// the right side of a merge never includes the first run
+	nr = nb + 1;
+	run[0] = 0;
+	run[nr] = sz;
+	scratch = (uint64_t*)aligned_malloc((sz - run[1]) * sizeof(uint64_t), 64);
+	if (scratch == NULL)
+		return -1;
+	
+	while (nr > 1)
+	{
+		for (i = 1, best = 0; i < nr - 1; i++)
+		{
+			if ((run[i + 2] - run[i]) < (run[best + 2] - run[best]))
+				best = i;
+		}
+		
+		merge_backward64(data + run[best], run[best + 1] - run[best], 
+			run[best + 2] - run[best + 1], scratch, dir);
+		memmove(run + best + 1, run + best + 2, (nr - best - 1) * sizeof(size_t));
+		nr--;
+	}
+	
+	aligned_free(scratch);
+	return 0;
+}
+
+static uint32_t scan_runs32(uint32_t *data, uint32_t sz, int dir, uint32_t *brk, int *fwd)
+{
+	// 32-bit version of scan_runs64
+	__m512i f = _mm512_set1_epi32(dir ? -1 : 0);
+	uint32_t i, nb = 0;
+	
+	*fwd = 0;
+	for (i = 0; i + 17 <= sz; i += 16)
+	{
+		__m512i a = _mm512_xor_si512(_mm512_loadu_si512(data + i), f);
+		__m512i b = _mm512_xor_si512(_mm512_loadu_si512(data + i + 1), f);
+		__mmask16 m = _mm512_cmpgt_epu32_mask(a, b);
+		
+		*fwd |= (_mm512_cmplt_epu32_mask(a, b) != 0);
+		while (m)
+		{
+			if (nb < ADAPT_RUNS - 1)
+				brk[nb] = i + _tzcnt_u32(m) + 1;
+			nb++;
+			m &= m - 1;
+		}
+		if ((nb >= ADAPT_RUNS) && *fwd)
+			return nb;
+	}
+	
+	for (; i + 1 < sz; i++)
+	{
+		if (AFTER(data[i], data[i + 1], dir))
+		{
+			if (nb < ADAPT_RUNS - 1)
+				brk[nb] = i + 1;
+			nb++;
+		}
+		else if (data[i] != data[i + 1])
+		{
+			*fwd = 1;
+		}
+	}
+	return nb;
+}
+
+static void reverse32(uint32_t *data, uint32_t sz)
+{
+	__m512i rev = _mm512_set_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	uint32_t i = 0, j = sz;
+	
+	while (j - i >= 32)
+	{
+		__m512i a = _mm512_loadu_si512(data + i);
+		__m512i b = _mm512_loadu_si512(data + j - 16);
+		
+		_mm512_storeu_si512(data + i, _mm512_permutexvar_epi32(rev, b));
+		_mm512_storeu_si512(data + j - 16, _mm512_permutexvar_epi32(rev, a));
+		i += 16;
+		j -= 16;
+	}
+	
+	for (; j - i >= 2; i++, j--)
+	{
+		uint32_t t = data[i];
+		data[i] = data[j - 1];
+		data[j - 1] = t;
+	}
+	return;
+}
+
+static int sort_adaptive32(uint32_t *data, uint32_t sz, int dir, int *done)
+{
+	// 32-bit version of sort_adaptive64
+	uint32_t run[ADAPT_RUNS + 1];
+	uint32_t nb;
+	uint32_t *scratch;
+	int fwd, nr, i, best;
+	
+	*done = 1;
+	nb = scan_runs32(data, sz, dir, run + 1, &fwd);
+	
+	if (nb == 0)
+		return 0;
+	
+	if (!fwd)
+	{
+		reverse32(data, sz);
+		return 0;
+	}
+	
+	if (nb >= ADAPT_RUNS)
+	{
+		*done = 0;
+		return 0;
+	}
+	
+	// the right side of a merge never includes the first run
+	nr = nb + 1;
+	run[0] = 0;
+	run[nr] = sz;
+	scratch = (uint32_t*)aligned_malloc((sz - run[1]) * sizeof(uint32_t), 64);
+	if (scratch == NULL)
+		return -1;
+	
+	while (nr > 1)
+	{
+		for (i = 1, best = 0; i < nr - 1; i++)
+		{
+			if ((run[i + 2] - run[i]) < (run[best + 2] - run[best]))
+				best = i;
+		}
+		
+		merge_backward32(data + run[best], run[best + 1] - run[best], 
+			run[best + 2] - run[best + 1], scratch, dir);
+		memmove(run + best + 1, run + best + 2, (nr - best - 1) * sizeof(uint32_t));
+		nr--;
+	}
+	
+	aligned_free(scratch);
+	return 0;
+}
+
+// bitonic merges spread over 'threads' threads, called from a task
+// inside a parallel region.  Each half-stride pass is split into
+// one task per thread and the two half-size merges become tasks 
+// with half the threads each, down to sequential merges.
+static void bitonic_merge_par(uint64_t *data, size_t sz, int dir, int threads)
+{
+	size_t nb = sz / 128;
+	int t;
+	
+	if ((threads <= 1) || (sz <= 64))
+	{
+		bitonic_merge(data, sz, dir);
+		return;
+	}
+	
+	for (t = 0; t < threads; t++)
+	{
+#pragma omp task
+		bitonic_merge_pass(data, sz, dir, nb * t / threads, nb * (t + 1) / threads);
+	}
+#pragma omp taskwait
+	
+#pragma omp task
+	bitonic_merge_par(data, sz / 2, dir, threads / 2);
+#pragma omp task
+	bitonic_merge_par(data + sz / 2, sz / 2, dir, threads - threads / 2);
+#pragma omp taskwait
+	
+	return;
+}
+
+static void bitonic_merge32_par(uint32_t *data, uint32_t sz, int dir, int threads)
+{
+	uint32_t nb = sz / 256;
+	int t;
+	
+	if ((threads <= 1) || (sz <= 128))
+	{
+		bitonic_merge32(data, sz, dir);
+		return;
+	}
+	
+	for (t = 0; t < threads; t++)
+	{
+#pragma omp task
+		bitonic_merge32_pass(data, sz, dir, 
+			(uint64_t)nb * t / threads, (uint64_t)nb * (t + 1) / threads);
+	}
+#pragma omp taskwait
+	
+#pragma omp task
+	bitonic_merge32_par(data, sz / 2, dir, threads / 2);
+#pragma omp task
+	bitonic_merge32_par(data + sz / 2, sz / 2, dir, threads - threads / 2);
+#pragma omp taskwait
+	
+	return;
+}
+
+static void bitonic_merge16_par(uint16_t *data, uint32_t sz, int dir, int threads)
+{
+	uint32_t nb = sz / 512;
+	int t;
+	
+	if ((threads <= 1) || (sz <= 256))
+	{
+		bitonic_merge16(data, sz, dir);
+		return;
+	}
+	
+	for (t = 0; t < threads; t++)
+	{
+#pragma omp task
+		bitonic_merge16_pass(data, sz, dir, 
+			(uint64_t)nb * t / threads, (uint64_t)nb * (t + 1) / threads);
+	}
+#pragma omp taskwait
+	
+#pragma omp task
+	bitonic_merge16_par(data, sz / 2, dir, threads / 2);
+#pragma omp task
+	bitonic_merge16_par(data + sz / 2, sz / 2, dir, threads - threads / 2);
+#pragma omp taskwait
+	
+	return;
+}
+
+static size_t co_rank64(size_t k, uint64_t *a, size_t na, uint64_t *b, size_t nb, int dir)
+{
+	// merge path co-ranking: the number of elements of a among the
+	// first k elements of the merge of a and b (ties go to a first).
+	size_t lo = (k > nb) ? k - nb : 0;
+	size_t hi = (k < na) ? k : na;
+	
+	while (lo < hi)
+	{
+		size_t i = lo + (hi - lo) / 2;
+		size_t j = k - i;
+		
+		if ((j > 0) && !AFTER(a[i], b[j - 1], dir))
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	return lo;
+}
+
+static void merge_forward64(uint64_t *out, uint64_t *a, size_t na, uint64_t *b, size_t nb, int dir)
+{
+	// out-of-place merge of the sorted runs a and b, 8 at a time 
+	// while both runs have 8 left.  Then one remainder is < 8: it 
+	// is merged with the carry and those are placed into the longer 
+	// remainder by binary search, with memcpy in between.
+	__attribute__((aligned(64))) uint64_t carry[8];
+	uint64_t small[16];
+	__mmask8 d = (dir == 0) ? 0 : 0xff;
+	size_t ia = 0, ib = 0, o = 0, nc = 0, ns = 0, ic = 0, ir = 0, k = 0;
+	size_t nr, nbig, s;
+	uint64_t *r, *big;
+	
+	if ((na >= 8) && (nb >= 8))
+	{
+		__m512i v = _mm512_loadu_si512(a);
+		__m512i c = _mm512_loadu_si512(b);
+		
+		ia = 8;
+		ib = 8;
+		merge8x8_64(&v, &c, d);
+		_mm512_storeu_si512(out, v);
+		o = 8;
+		
+		while ((ia + 8 <= na) && (ib + 8 <= nb))
+		{
+			if (AFTER(a[ia], b[ib], dir))
+			{
+				v = _mm512_loadu_si512(b + ib);
+				ib += 8;
+			}
+			else
+			{
+				v = _mm512_loadu_si512(a + ia);
+				ia += 8;
+			}
+			merge8x8_64(&v, &c, d);
+			_mm512_storeu_si512(out + o, v);
+			o += 8;
+		}
+		
+		_mm512_store_si512(carry, c);
+		nc = 8;
+	}
+	
+	if ((na - ia) <= (nb - ib))
+	{
+		r = a + ia;
+		nr = na - ia;
+		big = b + ib;
+		nbig = nb - ib;
+	}
+	else
+	{
+		r = b + ib;
+		nr = nb - ib;
+		big = a + ia;
+		nbig = na - ia;
+	}
+	
+	while ((ic < nc) || (ir < nr))
+	{
+		if ((ir == nr) || ((ic < nc) && !AFTER(carry[ic], r[ir], dir)))
+			small[ns++] = carry[ic++];
+		else
+			small[ns++] = r[ir++];
+	}
+	
+	for (s = 0; s < ns; s++)
+	{
+		size_t lo = k, hi = nbig;
+		
+		// first element of the long remainder that sorts after small[s]
+		while (lo < hi)
+		{
+			size_t mid = lo + (hi - lo) / 2;
+			if (AFTER(big[mid], small[s], dir))
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		
+		memcpy(out + o, big + k, (lo - k) * sizeof(uint64_t));
+		o += lo - k;
+		k = lo;
+		out[o++] = small[s];
+	}
+	memcpy(out + o, big + k, (nbig - k) * sizeof(uint64_t));
+	
+	return;
+}
+
+static void merge_par64(uint64_t *out, uint64_t *a, size_t na, uint64_t *b, size_t nb, int dir, int threads)
+{
+	// merge path parallel merge, from a task inside a parallel region:
+	// the output is cut into one equal piece per thread and co-ranking
+	// finds the parts of a and b that make up each piece.
+	size_t n = na + nb;
+	int t;
+	
+	if ((threads <= 1) || (n < 8192))
+	{
+		merge_forward64(out, a, na, b, nb, dir);
+		return;
+	}
+	
+	for (t = 0; t < threads; t++)
+	{
+#pragma omp task
+		{
+			size_t k0 = n * t / threads;
+			size_t k1 = n * (t + 1) / threads;
+			size_t i0 = co_rank64(k0, a, na, b, nb, dir);
+			size_t i1 = co_rank64(k1, a, na, b, nb, dir);
+			
+			merge_forward64(out + k0, a + i0, i1 - i0, 
+				b + (k0 - i0), (k1 - i1) - (k0 - i0), dir);
+		}
+	}
+#pragma omp taskwait
+	
+	return;
+}
+
+// merge two sorted arrays (both sorted in direction dir) into out, 
+// which must hold na + nb elements and not overlap a or b.  Any 
+// alignment; vectors of 8 / 16 / 32 elements are streamed through 
+// the merge network while both inputs have that many left.
+void merge_sorted_u64(uint64_t *a, size_t na, uint64_t *b, size_t nb, uint64_t *out, int dir)
+{
+	merge_forward64(out, a, na, b, nb, dir);
+	return;
+}
+
+void merge_sorted_u32(uint32_t *a, size_t na, uint32_t *b, size_t nb, uint32_t *out, int dir)
+{
+	merge_forward32(out, a, na, b, nb, dir);
+	return;
+}
+
+void merge_sorted_u16(uint16_t *a, size_t na, uint16_t *b, size_t nb, uint16_t *out, int dir)
+{
+	merge_forward16(out, a, na, b, nb, dir);
+	return;
+}
+
+static void parsort_pow2(uint64_t *data, size_t sz, int dir, int threads)
+{
+	// parallel bitonic sort of an aligned power-of-2 sized array, from
+	// a task inside a parallel region.  The array is cut into a power-of-2
+	// number of up/down sorted blocks, oversubscribed to at least 4 per
+	// thread when sz allows, so that any thread count stays busy: the 
+	// blocks are tasks picked up by whichever thread is free.
+	size_t nblocks = 1;
+	size_t bs, k;
+	
+	while ((nblocks < (size_t)threads * 4) && (sz / nblocks >= 8192))
+		nblocks *= 2;
+	
+	if (nblocks == 1)
+	{
+		bitonic_sort(data, sz, dir);
+		return;
+	}
+	
+	bs = sz / nblocks;
+	for (k = 0; k < nblocks; k++) {
+		// alternating up/down sorts so we can finish using merge only
+#pragma omp task
+		bitonic_sort(&data[k * bs], bs, k & 1);
+	}
+#pragma omp taskwait
+	
+	// merge rounds as tasks.  once there are fewer blocks than threads
+	// the spare threads work inside the merges of each block.
+	bs *= 2;
+	while (bs < sz)
+	{
+		int bt;
+		
+		nblocks = sz / bs;
+		bt = (int)(((size_t)threads + nblocks - 1) / nblocks);
+		
+		for (k = 0; k < nblocks; k++) {
+			// up/down merges of the previous up/down sorts, output is up/down sorted
+#pragma omp task
+			bitonic_merge_par(&data[k * bs], bs, k & 1, bt);
+		}
+#pragma omp taskwait
+		bs *= 2;
+	}
+	
+	// final merge in the specified direction
+	bitonic_merge_par(data, sz, dir, threads);
+	
+	return;
+}
+
+int parsort(uint64_t *data, size_t sz, int dir, int threads)
+{
+	// parallel sort for any size, alignment and thread count.
+	// power-of-2 sizes go to parsort_pow2.  Other sizes are split 
+	// like sort(): power-of-2 blocks, largest first, sorted concurrently 
+	// with the threads shared in proportion to their size, and a tail 
+	// of < 64.  These are combined right to left with merge path 
+	// parallel merges into a scratch array, which is copied back.
+	int is_aligned = (((uint64_t)data & 0x3full) == 0);
+	uint64_t *tmp = NULL;
+	size_t top;
+	
+	if (threads < 1)
+	{
+		return -1;
+	}
+	
+	if ((threads == 1) || (sz < 8192))
+	{
+		return sort_avx512(data, sz, dir);
+	}
+	
+	if (!is_aligned)
+	{
+		if (((uint64_t)data & 0x7ull) == 0)
+		{
+			// masked head + aligned rest, see sort()
+			uint32_t h = (64 - ((uint64_t)data & 0x3full)) / sizeof(uint64_t);
+			
+			sort_small64_xf(data, h, dir, XFORM_NONE);
+			if (parsort(data + h, sz - h, dir, threads) != 0)
+				return -1;
+			merge_head64(data, h, sz - h, dir);
+			return 0;
+		}
+		else
+		{
+			uint64_t *adata = (uint64_t*)aligned_malloc(sz * sizeof(uint64_t), 64);
+			int ret;
+			
+			if (adata == NULL)
+				return -1;
+			memcpy(adata, data, sz * sizeof(uint64_t));
+			ret = parsort(adata, sz, dir, threads);
+			memcpy(data, adata, sz * sizeof(uint64_t));
+			aligned_free(adata);
+			return ret;
+		}
+	}
+	
+	top = (size_t)1 << (63 - my_clz64(sz));
+	if (sz != top)
+	{
+		tmp = (uint64_t*)aligned_malloc(sz * sizeof(uint64_t), 64);
+		if (tmp == NULL)
+			return -1;
+	}
+	
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+	{
+		if (tmp == NULL)
+		{
+			parsort_pow2(data, sz, dir, threads);
+		}
+		else
+		{
+			size_t b, pos, tail;
+			int t;
+			
+			for (b = top, pos = 0; b >= 64; b >>= 1)
+			{
+				if (sz & b)
+				{
+					int bt = (int)(((size_t)threads * b + sz - 1) / sz);
+#pragma omp task
+					parsort_pow2(data + pos, b, dir, bt);
+					pos += b;
+				}
+			}
+			
+			tail = sz - pos;
+			if (tail > 0)
+			{
+				sort_small64_xf(data + pos, tail, dir, XFORM_NONE);
+			}
+#pragma omp taskwait
+			
+			for (b = 64; b <= top; b <<= 1)
+			{
+				if (sz & b)
+				{
+					pos -= b;
+					if (tail > 0)
+					{
+						size_t n = b + tail;
+						
+						merge_par64(tmp + pos, data + pos, b, data + pos + b, tail, dir, threads);
+						
+						for (t = 0; t < threads; t++)
+						{
+#pragma omp task
+							memcpy(data + pos + n * t / threads, tmp + pos + n * t / threads,
+								(n * (t + 1) / threads - n * t / threads) * sizeof(uint64_t));
+						}
+#pragma omp taskwait
+					}
+					tail += b;
+				}
+			}
+		}
+	}
+	
+	aligned_free(tmp);
+	return 0;
+}
+
+static size_t run_rank64(uint64_t *a, size_t n, uint64_t x, int dir, int incl)
+{
+	// number of elements of the sorted run a that sort before x,
+	// or (incl) before or equal to x.
+	size_t lo = 0, hi = n;
+	
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		
+		if (incl ? !AFTER(a[mid], x, dir) : AFTER(x, a[mid], dir))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void multi_co_rank64(size_t k, uint64_t **runs, size_t *len, int nruns, int dir, size_t *split)
+{
+	// co-ranking for several sorted runs: split[i] elements of run i
+	// are among the first k elements of their merge.  The k-th key is
+	// found by bisection over the key space (complemented when sorting
+	// down) and ties go to the lower numbered runs first, so the 
+	// splits of increasing k never cross.
+	uint64_t lo = 0, hi = ~0ull, x;
+	size_t cnt, rem = k;
+	int i;
+	
+	while (lo < hi)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+		
+		x = dir ? ~mid : mid;
+		for (i = 0, cnt = 0; i < nruns; i++)
+			cnt += run_rank64(runs[i], len[i], x, dir, 1);
+		
+		if (cnt >= k)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	
+	x = dir ? ~lo : lo;
+	for (i = 0; i < nruns; i++)
+	{
+		split[i] = run_rank64(runs[i], len[i], x, dir, 0);
+		rem -= split[i];
+	}
+	for (i = 0; i < nruns; i++)
+	{
+		size_t eq = run_rank64(runs[i], len[i], x, dir, 1) - split[i];
+		
+		if (eq > rem)
+			eq = rem;
+		split[i] += eq;
+		rem -= eq;
+	}
+	
+	return;
+}
+
+static void mergepath_team(uint64_t *data, size_t sz, int dir, uint64_t *tmp, 
+	size_t *blk, size_t *split, uint64_t **runs, size_t *len, int *err)
+{
+	// the body of parsort_mergepath, run by every thread of a parallel
+	// region.  blk needs p+1 entries, split (p+1)*p and runs/len p*p,
+	// for a team of p threads.
+	int t = omp_get_thread_num();
+	int p = omp_get_num_threads();
+	size_t k0 = sz * t / p;
+	size_t k1 = sz * (t + 1) / p;
+	uint64_t **r = runs + (size_t)t * p;
+	size_t *rl = len + (size_t)t * p;
+	uint64_t *dst = tmp + k0;
+	int i, n;
+	
+	// block boundaries on 64-byte multiples
+	for (i = t; i <= p; i += p)
+		blk[i] = (i == p) ? sz : ((sz * i / p) & ~(size_t)7);
+#pragma omp barrier
+	
+	if (sort_avx512(data + blk[t], blk[t + 1] - blk[t], dir) != 0)
+		*err = 1;
+	
+	// splits of this piece's first element within every block
+	for (i = 0; i < p; i++)
+	{
+		r[i] = data + blk[i];
+		rl[i] = blk[i + 1] - blk[i];
+	}
+#pragma omp barrier
+	
+	multi_co_rank64(k0, r, rl, p, dir, split + (size_t)t * p);
+	if (t == p - 1)
+	{
+		for (i = 0; i < p; i++)
+			split[(size_t)p * p + i] = rl[i];
+	}
+#pragma omp barrier
+	
+	for (i = 0; i < p; i++)
+	{
+		size_t s0 = split[(size_t)t * p + i];
+		
+		r[i] += s0;
+		rl[i] = split[(size_t)(t + 1) * p + i] - s0;
+	}
+	
+	// pairwise merge rounds.  every thread has p runs so all of 
+	// them meet the same barriers.  after the first round nothing
+	// reads the blocks anymore and data can be written.
+	n = p;
+	while (n > 1)
+	{
+		uint64_t *o = dst;
+		
+		for (i = 0; i < n / 2; i++)
+		{
+			merge_forward64(o, r[2 * i], rl[2 * i], r[2 * i + 1], rl[2 * i + 1], dir);
+			r[i] = o;
+			rl[i] = rl[2 * i] + rl[2 * i + 1];
+			o += rl[i];
+		}
+		if (n & 1)
+		{
+			memcpy(o, r[n - 1], rl[n - 1] * sizeof(uint64_t));
+			r[i] = o;
+			rl[i] = rl[n - 1];
+		}
+		n = (n + 1) / 2;
+		dst = (dst == tmp + k0) ? data + k0 : tmp + k0;
+#pragma omp barrier
+	}
+	
+	if (r[0] != data + k0)
+	{
+		memcpy(data + k0, r[0], (k1 - k0) * sizeof(uint64_t));
+	}
+	
+	return;
+}
+
+int parsort_mergepath(uint64_t *data, size_t sz, int dir, int threads)
+{
+	// alternative to parsort for large, memory bound sorts.  Each thread
+	// sorts one block with sort(), then the output is cut into one equal
+	// piece per thread and multiway co-ranking finds the parts of every
+	// block that make up each piece.  Each thread merges its parts 
+	// pairwise, first into a scratch array and then back and forth 
+	// between that and its own piece of data, so the data crosses 
+	// memory 1 + log2(threads) times after the block sorts instead of 
+	// once per bitonic merge round and pass.
+	uint64_t *tmp;
+	uint64_t **runs;
+	size_t *blk, *len, *split;
+	int err = 0;
+	
+	if (threads < 1)
+	{
+		return -1;
+	}
+	
+	if ((threads == 1) || (sz < 8192))
+	{
+		return sort_avx512(data, sz, dir);
+	}
+	
+	if (((uint64_t)data & 0x7ull) != 0)
+	{
+		uint64_t *adata = (uint64_t*)aligned_malloc(sz * sizeof(uint64_t), 64);
+		int ret;
+		
+		if (adata == NULL)
+			return -1;
+		memcpy(adata, data, sz * sizeof(uint64_t));
+		ret = parsort_mergepath(adata, sz, dir, threads);
+		memcpy(data, adata, sz * sizeof(uint64_t));
+		aligned_free(adata);
+		return ret;
+	}
+	
+	tmp = (uint64_t*)aligned_malloc(sz * sizeof(uint64_t), 64);
+	blk = (size_t*)malloc((threads + 1) * sizeof(size_t));
+	split = (size_t*)malloc((size_t)(threads + 1) * threads * sizeof(size_t));
+	len = (size_t*)malloc((size_t)threads * threads * sizeof(size_t));
+	runs = (uint64_t**)malloc((size_t)threads * threads * sizeof(uint64_t*));
+	
+	if ((tmp == NULL) || (blk == NULL) || (split == NULL) || 
+		(len == NULL) || (runs == NULL))
+	{
+		err = 1;
+		goto done;
+	}
+	
+#pragma omp parallel num_threads(threads)
+	mergepath_team(data, sz, dir, tmp, blk, split, runs, len, &err);
+	
+done:
+	aligned_free(tmp);
+	free(blk);
+	free(split);
+	free(len);
+	free(runs);
+	return err ? -1 : 0;
+}
+
+// state kept between calls to parsort_ctx
+typedef struct
+{
+	int threads;
+	size_t cap;
+	uint64_t *tmp;
+	size_t *blk;
+	size_t *split;
+	size_t *len;
+	uint64_t **runs;
+} sort_ctx_t;
+
+void sort_ctx_destroy(sort_ctx_t *ctx)
+{
+	if (ctx == NULL)
+		return;
+	
+	aligned_free(ctx->tmp);
+	free(ctx->blk);
+	free(ctx->split);
+	free(ctx->len);
+	free(ctx->runs);
+	free(ctx);
+	return;
+}
+
+sort_ctx_t *sort_ctx_create(int threads, size_t max_sz)
+{
+	// a reusable context for many parallel sorts: the scratch arrays 
+	// are allocated once here (and grown by parsort_ctx if needed), and
+	// every sort is one parallel region of a fixed size.  The OpenMP 
+	// runtime keeps such a team alive between regions, spinning for a
+	// while before it parks (OMP_WAIT_POLICY / GOMP_SPINCOUNT), so 
+	// back-to-back sorts pay no thread creation.  The team is started 
+	// here so the first sort doesn't pay for it either.
+	sort_ctx_t *ctx;
+	
+	if (threads < 1)
+		return NULL;
+	
+	ctx = (sort_ctx_t*)calloc(1, sizeof(sort_ctx_t));
+	if (ctx == NULL)
+		return NULL;
+	
+	ctx->threads = threads;
+	ctx->blk = (size_t*)malloc((threads + 1) * sizeof(size_t));
+	ctx->split = (size_t*)malloc((size_t)(threads + 1) * threads * sizeof(size_t));
+	ctx->len = (size_t*)malloc((size_t)threads * threads * sizeof(size_t));
+	ctx->runs = (uint64_t**)malloc((size_t)threads * threads * sizeof(uint64_t*));
+	if (max_sz > 0)
+	{
+		ctx->tmp = (uint64_t*)aligned_malloc(max_sz * sizeof(uint64_t), 64);
+		ctx->cap = max_sz;
+	}
+	
+	if ((ctx->blk == NULL) || (ctx->split == NULL) || (ctx->len == NULL) ||
+		(ctx->runs == NULL) || ((max_sz > 0) && (ctx->tmp == NULL)))
+	{
+		sort_ctx_destroy(ctx);
+		return NULL;
+	}
+	
+#pragma omp parallel num_threads(threads)
+	{
+		// warm up the team
+	}
+	
+	return ctx;
+}
+
+int parsort_ctx(sort_ctx_t *ctx, uint64_t *data, size_t sz, int dir)
+{
+	// parsort_mergepath on the context's team and scratch: one parallel
+	// region per sort with barriers between the phases, and no 
+	// allocation unless sz exceeds every earlier size.
+	int err = 0;
+	
+	if (ctx == NULL)
+	{
+		return -1;
+	}
+	
+	if ((ctx->threads == 1) || (sz < 8192))
+	{
+		return sort_avx512(data, sz, dir);
+	}
+	
+	if (((uint64_t)data & 0x7ull) != 0)
+	{
+		return parsort_mergepath(data, sz, dir, ctx->threads);
+	}
+	
+	if (sz > ctx->cap)
+	{
+		uint64_t *tmp = (uint64_t*)aligned_malloc(sz * sizeof(uint64_t), 64);
+		
+		if (tmp == NULL)
+			return -1;
+		aligned_free(ctx->tmp);
+		ctx->tmp = tmp;
+		ctx->cap = sz;
+	}
+	
+#pragma omp parallel num_threads(ctx->threads)
+	mergepath_team(data, sz, dir, ctx->tmp, ctx->blk, ctx->split, ctx->runs, ctx->len, &err);
+	
+	return err ? -1 : 0;
+}
+
+// k-way merge: a tree of two-way merges.  The leaves read the input 
+// runs in place and each inner node merges into a KWAY_BUF element 
+// buffer that its parent drains, so the working set stays in cache 
+// and every element is read from memory once.
+#define KWAY_BUF 2048
+
+typedef struct
+{
+	uint64_t *p[2];		// unread windows of the two inputs
+	size_t n[2];
+	int child[2];		// node feeding each input, -1 for a run or once exhausted
+	uint64_t *buf;
+} kway_node_t;
+
+static size_t kway_fill(kway_node_t *t, int x, uint64_t *out, size_t cap, int dir)
+{
+	// write up to cap of the next outputs of node x, refilling 
+	// the children as their windows empty.  Returns the count, 
+	// 0 once both inputs are exhausted.
+	kway_node_t *nd = &t[x];
+	size_t o = 0;
+	int s;
+	
+	while (o < cap)
+	{
+		size_t r, i;
+		
+		for (s = 0; s < 2; s++)
+		{
+			if ((nd->n[s] == 0) && (nd->child[s] >= 0))
+			{
+				int c = nd->child[s];
+				
+				nd->p[s] = t[c].buf;
+				nd->n[s] = kway_fill(t, c, t[c].buf, KWAY_BUF, dir);
+				if (nd->n[s] == 0)
+					nd->child[s] = -1;
+			}
+		}
+		
+		if ((nd->n[0] == 0) || (nd->n[1] == 0))
+		{
+			s = (nd->n[0] == 0);
+			if (nd->n[s] == 0)
+				break;
+			
+			r = (nd->n[s] < cap - o) ? nd->n[s] : cap - o;
+			memcpy(out + o, nd->p[s], r * sizeof(uint64_t));
+			nd->p[s] += r;
+			nd->n[s] -= r;
+			o += r;
+			continue;
+		}
+		
+		// only elements that sort no later than the ends of both 
+		// windows are final: later ones may lose to unread input.
+		if (AFTER(nd->p[0][nd->n[0] - 1], nd->p[1][nd->n[1] - 1], dir))
+			r = nd->n[1] + run_rank64(nd->p[0], nd->n[0], nd->p[1][nd->n[1] - 1], dir, 1);
+		else
+			r = nd->n[0] + run_rank64(nd->p[1], nd->n[1], nd->p[0][nd->n[0] - 1], dir, 1);
+		
+		if (r > cap - o)
+			r = cap - o;
+		i = co_rank64(r, nd->p[0], nd->n[0], nd->p[1], nd->n[1], dir);
+		merge_forward64(out + o, nd->p[0], i, nd->p[1], r - i, dir);
+		nd->p[0] += i;
+		nd->n[0] -= i;
+		nd->p[1] += r - i;
+		nd->n[1] -= r - i;
+		o += r;
+	}
+	
+	return o;
+}
+
+int merge_sorted_kway_u64(uint64_t **runs, size_t *lens, int k, uint64_t *out, int dir)
+{
+	// merge the k runs (each sorted in direction dir) into out, which 
+	// holds the sum of lens and does not overlap the runs.
+	kway_node_t *t;
+	uint64_t *bufs;
+	int *id;
+	int i, m, nn = 0;
+	size_t total = 0;
+	
+	if (k <= 0)
+		return 0;
+	
+	if (k == 1)
+	{
+		memcpy(out, runs[0], lens[0] * sizeof(uint64_t));
+		return 0;
+	}
+	
+	t = (kway_node_t*)malloc((k - 1) * sizeof(kway_node_t));
+	id = (int*)malloc(k * sizeof(int));
+	bufs = (uint64_t*)aligned_malloc((size_t)(k - 1) * KWAY_BUF * sizeof(uint64_t), 64);
+	if ((t == NULL) || (id == NULL) || (bufs == NULL))
+	{
+		free(t);
+		free(id);
+		aligned_free(bufs);
+		return -1;
+	}
+	
+	// build the tree a level at a time by pairing neighbors;
+	// id[] is a node number, or -(run + 1) for a run.
+	for (i = 0; i < k; i++)
+	{
+		id[i] = -(i + 1);
+		total += lens[i];
+	}
+	
+	for (m = k; m > 1; m = (m + 1) / 2)
+	{
+		for (i = 0; i < m / 2; i++)
+		{
+			kway_node_t *nd = &t[nn];
+			int s;
+			
+			for (s = 0; s < 2; s++)
+			{
+				int c = id[2 * i + s];
+				
+				if (c < 0)
+				{
+					nd->p[s] = runs[-c - 1];
+					nd->n[s] = lens[-c - 1];
+					nd->child[s] = -1;
+				}
+				else
+				{
+					nd->p[s] = NULL;
+					nd->n[s] = 0;
+					nd->child[s] = c;
+				}
+			}
+			nd->buf = bufs + (size_t)nn * KWAY_BUF;
+			id[i] = nn++;
+		}
+		if (m & 1)
+			id[m / 2] = id[m - 1];
+	}
+	
+	// the root writes straight to out
+	kway_fill(t, nn - 1, out, total, dir);
+	
+	free(t);
+	free(id);
+	aligned_free(bufs);
+	return 0;
+}
+
+int parsort32(uint32_t *data, uint32_t sz, int dir, int threads)
+{
+	// 32-bit version of parsort for power-of-2 sizes (at least 64)
+	// and aligned data, any thread count.
+	uint32_t nblocks = 1;
+	
+	if ((threads < 1) || ((sz & (sz - 1)) != 0) || (sz < 64) ||
+		(((uint64_t)data & 0x3full) != 0))
+	{
+		return -1;
+	}
+	
+	while ((nblocks < (uint32_t)threads * 4) && (sz / nblocks >= 16384))
+		nblocks *= 2;
+	
+	if ((threads == 1) || (nblocks == 1))
+	{
+		bitonic_sort32(data, sz, dir);
+		return 0;
+	}
+	
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+	{
+		// declared here so each task gets its own copy of k and bs
+		uint32_t bs, k;
+		
+		bs = sz / nblocks;
+		for (k = 0; k < nblocks; k++) {
+			// alternating up/down sorts so we can finish using merge only
+#pragma omp task
+			bitonic_sort32(&data[k * bs], bs, k & 1);
+		}
+#pragma omp taskwait
+		
+		bs *= 2;
+		while (bs < sz)
+		{
+			int bt;
+			
+			nblocks = sz / bs;
+			bt = (threads + nblocks - 1) / nblocks;
+			
+			for (k = 0; k < nblocks; k++) {
+				// up/down merges of the previous up/down sorts, output is up/down sorted
+#pragma omp task
+				bitonic_merge32_par(&data[k * bs], bs, k & 1, bt);
+			}
+#pragma omp taskwait
+			bs *= 2;
+		}
+		
+		// final merge in the specified direction
+		bitonic_merge32_par(data, sz, dir, threads);
+	}
+	
+	return 0;
+}
+
+int parsort16(uint16_t *data, uint32_t sz, int dir, int threads)
+{
+	// 16-bit version of parsort for power-of-2 sizes (at least 64)
+	// and aligned data, any thread count.
+	uint32_t nblocks = 1;
+	
+	if ((threads < 1) || ((sz & (sz - 1)) != 0) || (sz < 64) ||
+		(((uint64_t)data & 0x3full) != 0))
+	{
+		return -1;
+	}
+	
+	while ((nblocks < (uint32_t)threads * 4) && (sz / nblocks >= 32768))
+		nblocks *= 2;
+	
+	if ((threads == 1) || (nblocks == 1))
+	{
+		bitonic_sort16(data, sz, dir);
+		return 0;
+	}
+	
+#pragma omp parallel num_threads(threads)
+#pragma omp single
+	{
+		uint32_t bs, k;
+		
+		bs = sz / nblocks;
+		for (k = 0; k < nblocks; k++) {
+			// alternating up/down sorts so we can finish using merge only
+#pragma omp task
+			bitonic_sort16(&data[k * bs], bs, k & 1);
+		}
+#pragma omp taskwait
+		
+		bs *= 2;
+		while (bs < sz)
+		{
+			int bt;
+			
+			nblocks = sz / bs;
+			bt = (threads + nblocks - 1) / nblocks;
+			
+			for (k = 0; k < nblocks; k++) {
+				// up/down merges of the previous up/down sorts, output is up/down sorted
+#pragma omp task
+				bitonic_merge16_par(&data[k * bs], bs, k & 1, bt);
+			}
+#pragma omp taskwait
+			bs *= 2;
+		}
+		
+		// final merge in the specified direction
+		bitonic_merge16_par(data, sz, dir, threads);
+	}
+	
+	return 0;
+}
+
+int sort_batch(uint64_t *data, size_t list_len, size_t num_lists, int dir, int threads)
+{
+	// sorts num_lists contiguous lists of list_len elements each.  The
+	// path is chosen once for the whole batch: lists of up to 64 go to 
+	// the masked base case, aligned power-of-2 lists straight to 
+	// bitonic_sort, and anything else through sort().  Each thread 
+	// gets an equal run of lists, sorted back to back.
+	int is_aligned = (((uint64_t)data & 0x3full) == 0);
+	int path;
+	int err = 0;
+	size_t i;
+	
+	if (threads < 1)
+	{
+		return -1;
+	}
+	
+	if (list_len <= 64)
+		path = 0;
+	else if (is_aligned && ((list_len & (list_len - 1)) == 0))
+		path = 1;
+	else
+		path = 2;
+	
+#pragma omp parallel for num_threads(threads) schedule(static) reduction(|:err) \
+	if ((threads > 1) && (num_lists > 1) && (list_len * num_lists >= 16384))
+	for (i = 0; i < num_lists; i++)
+	{
+		uint64_t *list = data + i * list_len;
+		
+		if (path == 0)
+			sort_small64_xf(list, list_len, dir, XFORM_NONE);
+		else if (path == 1)
+			bitonic_sort_xf(list, list_len, dir, XFORM_NONE, XFORM_NONE);
+		else
+			err |= sort_avx512(list, list_len, dir);
+	}
+	
+	return err ? -1 : 0;
+}
+
+int sort_batch32(uint32_t *data, uint32_t list_len, size_t num_lists, int dir, int threads)
+{
+	// 32-bit version of sort_batch, the masked base case covers
+	// lists of up to 256.
+	int is_aligned = (((uint64_t)data & 0x3full) == 0);
+	int path;
+	int err = 0;
+	size_t i;
+	
+	if (threads < 1)
+	{
+		return -1;
+	}
+	
+	if (list_len <= 256)
+		path = 0;
+	else if (is_aligned && ((list_len & (list_len - 1)) == 0))
+		path = 1;
+	else
+		path = 2;
+	
+#pragma omp parallel for num_threads(threads) schedule(static) reduction(|:err) \
+	if ((threads > 1) && (num_lists > 1) && ((size_t)list_len * num_lists >= 32768))
+	for (i = 0; i < num_lists; i++)
+	{
+		uint32_t *list = data + i * list_len;
+		
+		if (path == 0)
+			sort_small32_xf(list, list_len, dir, XFORM_NONE);
+		else if (path == 1)
+			bitonic_sort32_xf(list, list_len, dir, XFORM_NONE, XFORM_NONE);
+		else
+			err |= sort32_avx512(list, list_len, dir);
+	}
+	
+	return err ? -1 : 0;
+}
+
+static int sort_segments_range(uint64_t *data, size_t *offsets, size_t s0, size_t s1, int dir)
+{
+	// segments s0 to s1-1, one at a time: the masked base case
+	// for up to 64 elements and sort() for the rest.
+	int err = 0;
+	size_t s;
+	
+	for (s = s0; s < s1; s++)
+	{
+		size_t len = offsets[s + 1] - offsets[s];
+		
+		if (len <= 1)
+			continue;
+		else if (len <= 64)
+			sort_small64_xf(data + offsets[s], len, dir, XFORM_NONE);
+		else
+			err |= sort_avx512(data + offsets[s], len, dir);
+	}
+	
+	return err;
+}
+
+static int sort_segments32_range(uint32_t *data, uint32_t *offsets, size_t s0, size_t s1, int dir)
+{
+	// segments s0 to s1-1.  Runs of three or more consecutive segments
+	// of up to 16 elements are grouped, up to 128 elements at a time, 
+	// into one 64-bit network: each key becomes 
+	// (segment in group << 32 | key), with the key complemented when 
+	// sorting down, so one ascending sort of the smallest network that 
+	// fits (64 or 128 lanes, the rest padded) sorts every segment of the
+	// group in its own place.  Other segments go to the 32-bit base 
+	// cases or sort32().
+	__attribute__((aligned(64))) uint64_t buf[128];
+	uint32_t flip = dir ? 0xffffffff : 0;
+	int err = 0;
+	size_t s = s0;
+	
+	while (s < s1)
+	{
+		uint32_t len = offsets[s + 1] - offsets[s];
+		uint32_t total = 0, net = 64, i, k;
+		size_t g0 = s;
+		
+		if (len > 16)
+		{
+			err |= sort32_avx512(data + offsets[s], len, dir);
+			s++;
+			continue;
+		}
+		
+		while ((s < s1) && ((len = offsets[s + 1] - offsets[s]) <= 16) && (total + len <= 128))
+		{
+			total += len;
+			s++;
+		}
+		
+		if (s - g0 < 3)
+		{
+			// a 64-bit network costs about two 32-bit ones
+			for (k = g0; k < s; k++)
+			{
+				len = offsets[k + 1] - offsets[k];
+				if (len > 1)
+					sort_small32_xf(data + offsets[k], len, dir, XFORM_NONE);
+			}
+			continue;
+		}
+		
+		for (k = 0, i = 0; g0 + k < s; k++)
+		{
+			uint32_t *seg = data + offsets[g0 + k];
+			uint32_t j;
+			
+			len = offsets[g0 + k + 1] - offsets[g0 + k];
+			for (j = 0; j < len; j++)
+				buf[i++] = ((uint64_t)k << 32) | (seg[j] ^ flip);
+		}
+		
+		while (net < total)
+			net *= 2;
+		for (; i < net; i++)
+			buf[i] = ~0ull;
+		
+		if (net == 64)
+			bitonic_sort_dir_64(buf, 0);
+		else
+			bitonic_sort_xf(buf, net, 0, XFORM_NONE, XFORM_NONE);
+		
+		for (i = 0; i < total; i++)
+			data[offsets[g0] + i] = (uint32_t)buf[i] ^ flip;
+	}
+	
+	return err;
+}
+
+static size_t segment_at(size_t *offsets, size_t num_segs, size_t pos)
+{
+	// first segment starting at or after element offset pos
+	size_t lo = 0, hi = num_segs;
+	
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		
+		if (offsets[mid] < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static size_t segment32_at(uint32_t *offsets, size_t num_segs, uint32_t pos)
+{
+	size_t lo = 0, hi = num_segs;
+	
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		
+		if (offsets[mid] < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int sort_segments(uint64_t *data, size_t *offsets, size_t num_segs, int dir, int threads)
+{
+	// sorts each of the num_segs segments data[offsets[s]] to 
+	// data[offsets[s+1] - 1] (CSR layout, num_segs + 1 offsets).
+	// Threads get contiguous runs of segments holding about the same
+	// number of elements; a segment is never split between threads.
+	size_t total, s;
+	int err = 0;
+	
+	if (threads < 1)
+	{
+		return -1;
+	}
+	
+	for (s = 0; s < num_segs; s++)
+	{
+		if (offsets[s + 1] < offsets[s])
+			return -1;
+	}
+	total = offsets[num_segs] - offsets[0];
+	
+#pragma omp parallel num_threads(threads) reduction(|:err) if ((threads > 1) && (total >= 16384))
+	{
+		int t = omp_get_thread_num();
+		int p = omp_get_num_threads();
+		size_t s0 = segment_at(offsets, num_segs, offsets[0] + total * t / p);
+		size_t s1 = segment_at(offsets, num_segs, offsets[0] + total * (t + 1) / p);
+		
+		err |= sort_segments_range(data, offsets, s0, s1, dir);
+	}
+	
+	return err ? -1 : 0;
+}
+
+int sort_segments32(uint32_t *data, uint32_t *offsets, size_t num_segs, int dir, int threads)
+{
+	// 32-bit version of sort_segments, with small segments grouped
+	// into shared networks.
+	uint32_t total;
+	size_t s;
+	int err = 0;
+	
+	if (threads < 1)
+	{
+		return -1;
+	}
+	
+	for (s = 0; s < num_segs; s++)
+	{
+		if (offsets[s + 1] < offsets[s])
+			return -1;
+	}
+	total = offsets[num_segs] - offsets[0];
+	
+#pragma omp parallel num_threads(threads) reduction(|:err) if ((threads > 1) && (total >= 32768))
+	{
+		int t = omp_get_thread_num();
+		int p = omp_get_num_threads();
+		size_t s0 = segment32_at(offsets, num_segs, offsets[0] + (uint32_t)((uint64_t)total * t / p));
+		size_t s1 = segment32_at(offsets, num_segs, offsets[0] + (uint32_t)((uint64_t)total * (t + 1) / p));
+		
+		err |= sort_segments32_range(data, offsets, s0, s1, dir);
+	}
+	
+	return err ? -1 : 0;
+}
+
+// key-value sorts: 64-bit keys with a parallel array of 64-bit values
+// that are moved in lockstep with the keys, using the same cmp/blend masks.
+// Like the key-only sorts these are not stable: values attached to
+// equal keys come out in an unspecified order.
+void bitonic_merge_kv_dir_64(uint64_t* keys, uint64_t* vals, int dir)
+{
+	// perform the final merge pass on 64 key/value pairs
+	__m512i t1;
+	__m512i dv1;
+	__m512i dv2;
+	__m512i dv3;
+	__m512i dv4;
+	__m512i dv5;
+	__m512i dv6;
+	__m512i dv7;
+	__m512i dv8;
+	__m512i vv1;
+	__m512i vv2;
+	__m512i vv3;
+	__m512i vv4;
+	__m512i vv5;
+	__m512i vv6;
+	__m512i vv7;
+	__m512i vv8;
+	__m512i dv1_swap;
+	__m512i dv2_swap;
+	__m512i dv3_swap;
+	__m512i dv4_swap;
+	__m512i dv5_swap;
+	__m512i dv6_swap;
+	__m512i dv7_swap;
+	__m512i dv8_swap;
+	__m512i vv1_swap;
+	__m512i vv2_swap;
+	__m512i vv3_swap;
+	__m512i vv4_swap;
+	__m512i vv5_swap;
+	__m512i vv6_swap;
+	__m512i vv7_swap;
+	__m512i vv8_swap;
+	__mmask8 m1;
+	__mmask8 m2;
+	__mmask8 m3;
+	__mmask8 m4;
+	__mmask8 m5;
+	__mmask8 m6;
+	__mmask8 m7;
+	__mmask8 m8;
+
+	dv1 = _mm512_load_epi64(keys);
+	dv2 = _mm512_load_epi64(keys + 8);
+	dv3 = _mm512_load_epi64(keys + 16);
+	dv4 = _mm512_load_epi64(keys + 24);
+	dv5 = _mm512_load_epi64(keys + 32);
+	dv6 = _mm512_load_epi64(keys + 40);
+	dv7 = _mm512_load_epi64(keys + 48);
+	dv8 = _mm512_load_epi64(keys + 56);
+	vv1 = _mm512_load_epi64(vals);
+	vv2 = _mm512_load_epi64(vals + 8);
+	vv3 = _mm512_load_epi64(vals + 16);
+	vv4 = _mm512_load_epi64(vals + 24);
+	vv5 = _mm512_load_epi64(vals + 32);
+	vv6 = _mm512_load_epi64(vals + 40);
+	vv7 = _mm512_load_epi64(vals + 48);
+	vv8 = _mm512_load_epi64(vals + 56);
+
+	if (dir == 1)
+	{
+		MERGE64_KV(CLT);
+	}
+	else
+	{
+		MERGE64_KV(CGT);
+	}
+
+	_mm512_store_epi64(keys, dv1);
+	_mm512_store_epi64(keys + 8, dv2);
+	_mm512_store_epi64(keys + 16, dv3);
+	_mm512_store_epi64(keys + 24, dv4);
+	_mm512_store_epi64(keys + 32, dv5);
+	_mm512_store_epi64(keys + 40, dv6);
+	_mm512_store_epi64(keys + 48, dv7);
+	_mm512_store_epi64(keys + 56, dv8);
+	_mm512_store_epi64(vals, vv1);
+	_mm512_store_epi64(vals + 8, vv2);
+	_mm512_store_epi64(vals + 16, vv3);
+	_mm512_store_epi64(vals + 24, vv4);
+	_mm512_store_epi64(vals + 32, vv5);
+	_mm512_store_epi64(vals + 40, vv6);
+	_mm512_store_epi64(vals + 48, vv7);
+	_mm512_store_epi64(vals + 56, vv8);
+
+	return;
+}
+
+void bitonic_sort_kv_dir_64(uint64_t* keys, uint64_t* vals, int dir)
+{
+	// sort 64 key/value pairs.  Same network as bitonic_sort_dir_64.
+	__m512i t1;
+	__m512i dv1;
+	__m512i dv2;
+	__m512i dv3;
+	__m512i dv4;
+	__m512i dv5;
+	__m512i dv6;
+	__m512i dv7;
+	__m512i dv8;
+	__m512i vv1;
+	__m512i vv2;
+	__m512i vv3;
+	__m512i vv4;
+	__m512i vv5;
+	__m512i vv6;
+	__m512i vv7;
+	__m512i vv8;
+	__m512i dv1_swap;
+	__m512i dv2_swap;
+	__m512i dv3_swap;
+	__m512i dv4_swap;
+	__m512i dv5_swap;
+	__m512i dv6_swap;
+	__m512i dv7_swap;
+	__m512i dv8_swap;
+	__m512i vv1_swap;
+	__m512i vv2_swap;
+	__m512i vv3_swap;
+	__m512i vv4_swap;
+	__m512i vv5_swap;
+	__m512i vv6_swap;
+	__m512i vv7_swap;
+	__m512i vv8_swap;
+	__mmask8 m1;
+	__mmask8 m2;
+	__mmask8 m3;
+	__mmask8 m4;
+	__mmask8 m5;
+	__mmask8 m6;
+	__mmask8 m7;
+	__mmask8 m8;
+
+	dv1 = _mm512_load_epi64(keys);
+	dv2 = _mm512_load_epi64(keys + 8);
+	dv3 = _mm512_load_epi64(keys + 16);
+	dv4 = _mm512_load_epi64(keys + 24);
+	dv5 = _mm512_load_epi64(keys + 32);
+	dv6 = _mm512_load_epi64(keys + 40);
+	dv7 = _mm512_load_epi64(keys + 48);
+	dv8 = _mm512_load_epi64(keys + 56);
+	vv1 = _mm512_load_epi64(vals);
+	vv2 = _mm512_load_epi64(vals + 8);
+	vv3 = _mm512_load_epi64(vals + 16);
+	vv4 = _mm512_load_epi64(vals + 24);
+	vv5 = _mm512_load_epi64(vals + 32);
+	vv6 = _mm512_load_epi64(vals + 40);
+	vv7 = _mm512_load_epi64(vals + 48);
+	vv8 = _mm512_load_epi64(vals + 56);
+
+	// phase 1 : dist-2 alternating compares
+	SWAPKV64x8(SWAP64);
+	CMP64(dv1, dv2, dv3, dv4, dv5, dv6, dv7, dv8, CGT, CGT, CGT, CGT, CGT, CGT, CGT, CGT);
+	BLENDMASK64_KV(0x66, 0x55, 1);
+
+	// phase 2 : dist-4 alternating compares
+	SWAPKV64x8(SWAP128);
+	CMP64(dv1, dv2, dv3, dv4, dv5, dv6, dv7, dv8, CGT, CGT, CGT, CGT, CGT, CGT, CGT, CGT);
+	BLENDMASK64_KV(0x3C, 0x33, 2);
+
+	SWAPKV64x8(SWAP64);
+	CMP64(dv1, dv2, dv3, dv4, dv5, dv6, dv7, dv8, CGT, CGT, CGT, CGT, CGT, CGT, CGT, CGT);
+	BLENDMASK64_KV(0x5A, 0x55, 1);
+
+	// phase 3 : dist-8 alternating compares
+	SWAPKV64x8(SWAP256);
+	CMP64(dv1, dv2, dv3, dv4, dv5, dv6, dv7, dv8, CGT, CLT, CGT, CLT, CGT, CLT, CGT, CLT);
+	BLENDMASK64_KV(0xF0, 0x0F, 4);
+
+	SWAPKV64x8(SWAP128);
+	CMP64(dv1, dv2, dv3, dv4, dv5, dv6, dv7, dv8, CGT, CLT, CGT, CLT, CGT, CLT, CGT, CLT);
+	BLENDMASK64_KV(0xCC, 0x33, 2);
+
+	SWAPKV64x8(SWAP64);
+	CMP64(dv1, dv2, dv3, dv4, dv5, dv6, dv7, dv8, CGT, CLT, CGT, CLT, CGT, CLT, CGT, CLT);
+	BLENDMASK64_KV(0xAA, 0x55, 1);
+
+	// phase 4 : dist-16 alternating compares
+	CMPXCHG64_KV(m1, CGT, dv1, dv2, vv1, vv2);
+	CMPXCHG64_KV(m2, CLT, dv3, dv4, vv3, vv4);
+	CMPXCHG64_KV(m3, CGT, dv5, dv6, vv5, vv6);
+	CMPXCHG64_KV(m4, CLT, dv7, dv8, vv7, vv8);
+
+	SWAPKV64x8(SWAP256);
+	CMP64(dv1, dv2, dv3, dv4, dv5, dv6, dv7, dv8, CGT, CGT, CLT, CLT, CGT, CGT, CLT, CLT);
+	BLENDMASK64_KV(0xF0, 0x0F, 4);
+
+	SWAPKV64x8(SWAP128);
+	CMP64(dv1, dv2, dv3, dv4, dv5, dv6, dv7, dv8, CGT, CGT, CLT, CLT, CGT, CGT, CLT, CLT);
+	BLENDMASK64_KV(0xCC, 0x33, 2);
+
+	SWAPKV64x8(SWAP64);
+	CMP64(dv1, dv2, dv3, dv4, dv5, dv6, dv7, dv8, CGT, CGT, CLT, CLT, CGT, CGT, CLT, CLT);
+	BLENDMASK64_KV(0xAA, 0x55, 1);
+
+	// phase 5 : dist-32 alternating compares
+	CMPXCHG64_KV(m1, CGT, dv1, dv3, vv1, vv3);
+	CMPXCHG64_KV(m2, CGT, dv2, dv4, vv2, vv4);
+	CMPXCHG64_KV(m3, CLT, dv5, dv7, vv5, vv7);
+	CMPXCHG64_KV(m4, CLT, dv6, dv8, vv6, vv8);
+
+	CMPXCHG64_KV(m1, CGT, dv1, dv2, vv1, vv2);
+	CMPXCHG64_KV(m2, CGT, dv3, dv4, vv3, vv4);
+	CMPXCHG64_KV(m3, CLT, dv5, dv6, vv5, vv6);
+	CMPXCHG64_KV(m4, CLT, dv7, dv8, vv7, vv8);
+
+	SWAPKV64x8(SWAP256);
+	CMP64(dv1, dv2, dv3, dv4, dv5, dv6, dv7, dv8, CGT, CGT, CGT, CGT, CLT, CLT, CLT, CLT);
+	BLENDMASK64_KV(0xF0, 0x0F, 4);
+
+	SWAPKV64x8(SWAP128);
+	CMP64(dv1, dv2, dv3, dv4, dv5, dv6, dv7, dv8, CGT, CGT, CGT, CGT, CLT, CLT, CLT, CLT);
+	BLENDMASK64_KV(0xCC, 0x33, 2);
+
+	SWAPKV64x8(SWAP64);
+	CMP64(dv1, dv2, dv3, dv4, dv5, dv6, dv7, dv8, CGT, CGT, CGT, CGT, CLT, CLT, CLT, CLT);
+	BLENDMASK64_KV(0xAA, 0x55, 1);
+
+	// phase 6 : merge in the specified direction
+	if (dir == 1)
+	{
+		MERGE64_KV(CLT);
+	}
+	else
+	{
+		MERGE64_KV(CGT);
+	}
+
+	_mm512_store_epi64(keys, dv1);
+	_mm512_store_epi64(keys + 8, dv2);
+	_mm512_store_epi64(keys + 16, dv3);
+	_mm512_store_epi64(keys + 24, dv4);
+	_mm512_store_epi64(keys + 32, dv5);
+	_mm512_store_epi64(keys + 40, dv6);
+	_mm512_store_epi64(keys + 48, dv7);
+	_mm512_store_epi64(keys + 56, dv8);
+	_mm512_store_epi64(vals, vv1);
+	_mm512_store_epi64(vals + 8, vv2);
+	_mm512_store_epi64(vals + 16, vv3);
+	_mm512_store_epi64(vals + 24, vv4);
+	_mm512_store_epi64(vals + 32, vv5);
+	_mm512_store_epi64(vals + 40, vv6);
+	_mm512_store_epi64(vals + 48, vv7);
+	_mm512_store_epi64(vals + 56, vv8);
+
+	return;
+}
+
+void bitonic_merge_kv(uint64_t *keys, uint64_t *vals, size_t sz, int dir)
+{
+	if (sz <= 64)
+	{
+		// base case: do the hardcoded 64-element merge
+		bitonic_merge_kv_dir_64(keys, vals, dir);
+		return;
+	}
+
+	// half-size cmp/swap
+	size_t i;
+	size_t h = sz / 2;
+	__m512i t1;
+	__m512i dv1;
+	__m512i dv2;
+	__m512i dv3;
+	__m512i dv4;
+	__m512i dv5;
+	__m512i dv6;
+	__m512i dv7;
+	__m512i dv8;
+	__m512i vv1;
+	__m512i vv2;
+	__m512i vv3;
+	__m512i vv4;
+	__m512i vv5;
+	__m512i vv6;
+	__m512i vv7;
+	__m512i vv8;
+	__mmask8 m1;
+	__mmask8 m2;
+	__mmask8 m3;
+	__mmask8 m4;
+
+	// 32-element passes at a stride of sz/2.  Half the batch size 
+	// of bitonic_merge because the values double the register count.
+	for (i = 0; i < h; i += 32)
+	{
+		dv1 = _mm512_load_epi64(keys + i + 0);
+		dv2 = _mm512_load_epi64(keys + i + 8);
+		dv3 = _mm512_load_epi64(keys + i + 16);
+		dv4 = _mm512_load_epi64(keys + i + 24);
+		dv5 = _mm512_load_epi64(keys + i + h + 0);
+		dv6 = _mm512_load_epi64(keys + i + h + 8);
+		dv7 = _mm512_load_epi64(keys + i + h + 16);
+		dv8 = _mm512_load_epi64(keys + i + h + 24);
+		vv1 = _mm512_load_epi64(vals + i + 0);
+		vv2 = _mm512_load_epi64(vals + i + 8);
+		vv3 = _mm512_load_epi64(vals + i + 16);
+		vv4 = _mm512_load_epi64(vals + i + 24);
+		vv5 = _mm512_load_epi64(vals + i + h + 0);
+		vv6 = _mm512_load_epi64(vals + i + h + 8);
+		vv7 = _mm512_load_epi64(vals + i + h + 16);
+		vv8 = _mm512_load_epi64(vals + i + h + 24);
+
+		if (dir == 1)
+		{
+			CMPXCHG64_KV(m1, CLT, dv1, dv5, vv1, vv5);
+			CMPXCHG64_KV(m2, CLT, dv2, dv6, vv2, vv6);
+			CMPXCHG64_KV(m3, CLT, dv3, dv7, vv3, vv7);
+			CMPXCHG64_KV(m4, CLT, dv4, dv8, vv4, vv8);
+		}
+		else
+		{
+			CMPXCHG64_KV(m1, CGT, dv1, dv5, vv1, vv5);
+			CMPXCHG64_KV(m2, CGT, dv2, dv6, vv2, vv6);
+			CMPXCHG64_KV(m3, CGT, dv3, dv7, vv3, vv7);
+			CMPXCHG64_KV(m4, CGT, dv4, dv8, vv4, vv8);
+		}
+
+		_mm512_store_epi64(keys + i + 0, dv1);
+		_mm512_store_epi64(keys + i + 8, dv2);
+		_mm512_store_epi64(keys + i + 16, dv3);
+		_mm512_store_epi64(keys + i + 24, dv4);
+		_mm512_store_epi64(keys + i + h + 0, dv5);
+		_mm512_store_epi64(keys + i + h + 8, dv6);
+		_mm512_store_epi64(keys + i + h + 16, dv7);
+		_mm512_store_epi64(keys + i + h + 24, dv8);
+		_mm512_store_epi64(vals + i + 0, vv1);
+		_mm512_store_epi64(vals + i + 8, vv2);
+		_mm512_store_epi64(vals + i + 16, vv3);
+		_mm512_store_epi64(vals + i + 24, vv4);
+		_mm512_store_epi64(vals + i + h + 0, vv5);
+		_mm512_store_epi64(vals + i + h + 8, vv6);
+		_mm512_store_epi64(vals + i + h + 16, vv7);
+		_mm512_store_epi64(vals + i + h + 24, vv8);
+	}
+
+	// two half-size merges
+	bitonic_merge_kv(keys, vals, h, dir);
+	bitonic_merge_kv(keys + h, vals + h, h, dir);
+}
+
+void bitonic_sort_kv(uint64_t *keys, uint64_t *vals, size_t sz, int dir)
+{
+	if (sz == 64)
+	{
+		// base case: do the hardcoded 64-element sort
+		bitonic_sort_kv_dir_64(keys, vals, dir);
+		return;
+	}
+
+	// two half-size bitonic sorts,
+	// with opposite directions.
+	bitonic_sort_kv(keys, vals, sz / 2, 0);
+	bitonic_sort_kv(keys + sz / 2, vals + sz / 2, sz / 2, 1);
+
+	// merge in the specified direction
+	bitonic_merge_kv(keys, vals, sz, dir);
+
+	return;
+}
+
+int sort_kv(uint64_t *keys, uint64_t *vals, size_t sz, int dir)
+{
+	// top level key-value sort: keys and vals can have any size and
+	// alignment.  bitonic_sort_kv itself needs both arrays 64-byte
+	// aligned and a power-of-2 size of at least 64, so anything else
+	// is sorted in padded aligned copies.
+	int is_aligned = ((((uint64_t)keys | (uint64_t)vals) & 0x3full) == 0);
+	size_t new_sz = sz;
+	
+	if (sz < 64)
+	{
+		new_sz = 64;
+	}
+	else if ((sz & (sz - 1)) > 0)
+	{
+		new_sz = next_power_2(sz);
+	}
+	
+	if (is_aligned && (new_sz == sz))
+	{
+		// meets both requirements as-is
+		bitonic_sort_kv(keys, vals, sz, dir);
+		return 0;
+	}
+
+	// otherwise sort padded copies.  A padding key ties with any real
+	// key of the same value, which would let a padding value get 
+	// copied out in place of a real one.  So real pairs holding the 
+	// padding key are held back and appended after the sort: 
+	// that key sorts last in either direction.
+	uint64_t pad = (dir == 0) ? 0xffffffffffffffffull : 0;
+	__m512i vpad = _mm512_set1_epi64(pad);
+	uint64_t *akeys = (uint64_t*)aligned_malloc(new_sz * sizeof(uint64_t), 64);
+	uint64_t *avals = (uint64_t*)aligned_malloc(new_sz * sizeof(uint64_t), 64);
+	uint64_t *pvals = NULL;
+	size_t i, n = 0, np = 0;
+	
+	if ((akeys == NULL) || (avals == NULL))
+	{
+		aligned_free(akeys);
+		aligned_free(avals);
+		return -1;
+	}
+	
+	for (i = 0; i + 8 <= sz; i += 8)
+	{
+		__m512i k = _mm512_loadu_si512(keys + i);
+		__m512i v = _mm512_loadu_si512(vals + i);
+		__mmask8 m = _mm512_cmpneq_epu64_mask(k, vpad);
+		_mm512_mask_compressstoreu_epi64(akeys + n, m, k);
+		_mm512_mask_compressstoreu_epi64(avals + n, m, v);
+		n += _mm_popcnt_u32(m);
+	}
+	for ( ; i < sz; i++)
+	{
+		if (keys[i] != pad)
+		{
+			akeys[n] = keys[i];
+			avals[n++] = vals[i];
+		}
+	}
+	
+	if (n < sz)
+	{
+		pvals = (uint64_t*)malloc((sz - n) * sizeof(uint64_t));
+		if (pvals == NULL)
+		{
+			aligned_free(akeys);
+			aligned_free(avals);
+			return -1;
+		}
+		for (i = 0; i < sz; i++)
+		{
+			if (keys[i] == pad)
+				pvals[np++] = vals[i];
+		}
+	}
+	
+	for (i = n; i < new_sz; i++)
+	{
+		akeys[i] = pad;
+		avals[i] = 0;
+	}
+	
+	bitonic_sort_kv(akeys, avals, new_sz, dir);
+	
+	memcpy(keys, akeys, n * sizeof(uint64_t));
+	memcpy(vals, avals, n * sizeof(uint64_t));
+	for (i = 0; i < np; i++)
+	{
+		keys[n + i] = pad;
+		vals[n + i] = pvals[i];
+	}
+	
+	free(pvals);
+	aligned_free(akeys);
+	aligned_free(avals);
+	return 0;
+}
+
+// 32-bit keys with 32-bit payloads: each pair is packed into one 64-bit
+// lane as key:payload and sorted with the 64-bit network.  Comparing the
+// whole lane orders by key first, and pairs with equal keys come out 
+// ordered by payload (so the sort is stable if the payloads are row 
+// indices in increasing order and dir == 0).
+static void pack_kv32(uint64_t *packed, uint32_t *keys, uint32_t *vals, uint32_t sz)
+{
+	uint32_t i;
+	for (i = 0; i + 16 <= sz; i += 16)
+	{
+		__m512i k = _mm512_loadu_si512(keys + i);
+		__m512i v = _mm512_loadu_si512(vals + i);
+		__m512i lo = _mm512_or_si512(
+			_mm512_slli_epi64(_mm512_cvtepu32_epi64(_mm512_castsi512_si256(k)), 32),
+			_mm512_cvtepu32_epi64(_mm512_castsi512_si256(v)));
+		__m512i hi = _mm512_or_si512(
+			_mm512_slli_epi64(_mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(k, 1)), 32),
+			_mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(v, 1)));
+		_mm512_storeu_si512(packed + i, lo);
+		_mm512_storeu_si512(packed + i + 8, hi);
+	}
+	for ( ; i < sz; i++)
+	{
+		packed[i] = ((uint64_t)keys[i] << 32) | vals[i];
+	}
+	return;
+}
+
+static void unpack_kv32(uint64_t *packed, uint32_t *keys, uint32_t *vals, uint32_t sz)
+{
+	uint32_t i;
+	for (i = 0; i + 8 <= sz; i += 8)
+	{
+		__m512i p = _mm512_loadu_si512(packed + i);
+		_mm256_storeu_si256((__m256i *)(keys + i), _mm512_cvtepi64_epi32(_mm512_srli_epi64(p, 32)));
+		_mm256_storeu_si256((__m256i *)(vals + i), _mm512_cvtepi64_epi32(p));
+	}
+	for ( ; i < sz; i++)
+	{
+		keys[i] = (uint32_t)(packed[i] >> 32);
+		vals[i] = (uint32_t)packed[i];
+	}
+	return;
+}
+
+void bitonic_sort_kv32_dir_64(uint32_t* keys, uint32_t* vals, int dir)
+{
+	// sort 64 key/payload pairs through an L1-resident packed buffer
+	__attribute__((aligned(64))) uint64_t packed[64];
+	
+	pack_kv32(packed, keys, vals, 64);
+	bitonic_sort_dir_64(packed, dir);
+	unpack_kv32(packed, keys, vals, 64);
+	return;
+}
+
+int sort_kv32(uint32_t *keys, uint32_t *vals, uint32_t sz, int dir)
+{
+	// top level 32-bit key/payload sort for arbitrary sizes and alignment.
+	// packed pairs equal to the padding value are indistinguishable from 
+	// it, so unlike sort_kv() no pairs need to be held back.
+	uint64_t pad = (dir == 0) ? 0xffffffffffffffffull : 0;
+	uint32_t i;
+	
+	if (sz <= 64)
+	{
+		__attribute__((aligned(64))) uint64_t packed[64];
+		
+		pack_kv32(packed, keys, vals, sz);
+		for (i = sz; i < 64; i++)
+			packed[i] = pad;
+		bitonic_sort_dir_64(packed, dir);
+		unpack_kv32(packed, keys, vals, sz);
+		return 0;
+	}
+	
+	uint32_t new_sz = sz;
+	if ((sz & (sz - 1)) > 0)
+	{
+		// padded sizes must fit in 32 bits
+		if (sz > 0x80000000u)
+			return -1;
+		new_sz = next_power_2(sz);
+	}
+	
+	uint64_t *packed = (uint64_t*)aligned_malloc(new_sz * sizeof(uint64_t), 64);
+	if (packed == NULL)
+		return -1;
+	
+	pack_kv32(packed, keys, vals, sz);
+	for (i = sz; i < new_sz; i++)
+		packed[i] = pad;
+	bitonic_sort(packed, new_sz, dir);
+	unpack_kv32(packed, keys, vals, sz);
+	
+	aligned_free(packed);
+	return 0;
+}
+
+// argsorts: leave the input untouched and write the permutation that
+// sorts it into idx, i.e. data[idx[0]], data[idx[1]], ... is sorted.
+// The index rides along with its key through the same network, either
+// packed into the low bits of a wider lane or as the value of a kv sort.
+static void argsort_packed64(uint64_t *packed, uint32_t *idx, uint32_t sz, int dir)
+{
+	// sort keys packed as key:index into 64-bit lanes and extract the
+	// indices.  packed has room for the padding up to the next power of 2
+	// (at least 64).  A real lane can only be equal to the padding
+	// if it is all 0's, in which case the index extracted is the same.
+	uint64_t pad = (dir == 0) ? 0xffffffffffffffffull : 0;
+	uint32_t i, new_sz = sz;
+	
+	if (sz < 64)
+	{
+		new_sz = 64;
+	}
+	else if ((sz & (sz - 1)) > 0)
+	{
+		new_sz = next_power_2(sz);
+	}
+	
+	for (i = sz; i < new_sz; i++)
+		packed[i] = pad;
+	
+	bitonic_sort(packed, new_sz, dir);
+	
+	for (i = 0; i + 8 <= sz; i += 8)
+	{
+		_mm256_storeu_si256((__m256i *)(idx + i), 
+			_mm512_cvtepi64_epi32(_mm512_load_si512(packed + i)));
+	}
+	for ( ; i < sz; i++)
+	{
+		idx[i] = (uint32_t)packed[i];
+	}
+	return;
+}
+
+int argsort(uint64_t *data, uint32_t *idx, uint32_t sz, int dir)
+{
+	// 64-bit keys: kv sort of a copy of the keys, with the indices as values.
+	// the padding carries indices >= sz and is filtered out afterwards,
+	// so unlike sort_kv() real keys equal to the padding key need no
+	// special handling.
+	uint64_t pad = (dir == 0) ? 0xffffffffffffffffull : 0;
+	uint32_t i, n, new_sz = sz;
+	
+	if (sz < 64)
+	{
+		new_sz = 64;
+	}
+	else if ((sz & (sz - 1)) > 0)
+	{
+		// padded sizes must fit in 32 bits
+		if (sz > 0x80000000u)
+			return -1;
+		new_sz = next_power_2(sz);
+	}
+	
+	uint64_t *akeys = (uint64_t*)aligned_malloc(new_sz * sizeof(uint64_t), 64);
+	uint64_t *avals = (uint64_t*)aligned_malloc(new_sz * sizeof(uint64_t), 64);
+	__m512i vidx = _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+	__m512i vinc = _mm512_set1_epi64(8);
+	__m512i vsz = _mm512_set1_epi64(sz);
+	
+	if ((akeys == NULL) || (avals == NULL))
+	{
+		aligned_free(akeys);
+		aligned_free(avals);
+		return -1;
+	}
+	
+	memcpy(akeys, data, sz * sizeof(uint64_t));
+	for (i = sz; i < new_sz; i++)
+		akeys[i] = pad;
+	for (i = 0; i < new_sz; i += 8)
+	{
+		_mm512_store_si512(avals + i, vidx);
+		vidx = _mm512_add_epi64(vidx, vinc);
+	}
+	
+	bitonic_sort_kv(akeys, avals, new_sz, dir);
+	
+	for (i = 0, n = 0; i < new_sz; i += 8)
+	{
+		__m512i v = _mm512_load_si512(avals + i);
+		__mmask8 m = _mm512_cmplt_epu64_mask(v, vsz);
+		_mm256_mask_compressstoreu_epi32(idx + n, m, _mm512_cvtepi64_epi32(v));
+		n += _mm_popcnt_u32(m);
+	}
+	
+	aligned_free(akeys);
+	aligned_free(avals);
+	return 0;
+}
+
+int argsort32(uint32_t *data, uint32_t *idx, uint32_t sz, int dir)
+{
+	// 32-bit keys: pack key:index into 64-bit lanes (bitonic_sort_dir_64)
+	uint32_t i;
+	uint32_t new_sz = (sz < 64) ? 64 : sz;
+	
+	if ((new_sz & (new_sz - 1)) > 0)
+	{
+		// padded sizes must fit in 32 bits
+		if (new_sz > 0x80000000u)
+			return -1;
+		new_sz = next_power_2(new_sz);
+	}
+	
+	uint64_t *packed = (uint64_t*)aligned_malloc(new_sz * sizeof(uint64_t), 64);
+	if (packed == NULL)
+		return -1;
+	__m512i vidx = _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+	__m512i vinc = _mm512_set1_epi64(8);
+	
+	for (i = 0; i + 8 <= sz; i += 8)
+	{
+		__m512i k = _mm512_cvtepu32_epi64(_mm256_loadu_si256((__m256i *)(data + i)));
+		_mm512_store_si512(packed + i, _mm512_or_si512(_mm512_slli_epi64(k, 32), vidx));
+		vidx = _mm512_add_epi64(vidx, vinc);
+	}
+	for ( ; i < sz; i++)
+	{
+		packed[i] = ((uint64_t)data[i] << 32) | i;
+	}
+	
+	argsort_packed64(packed, idx, sz, dir);
+	
+	aligned_free(packed);
+	return 0;
+}
+
+int argsort16(uint16_t *data, uint32_t *idx, uint32_t sz, int dir)
+{
+	// 16-bit keys: while the index fits in 16 bits pack key:index into
+	// 32-bit lanes (bitonic_sort32_dir_256), otherwise into 64-bit lanes.
+	uint32_t i;
+	uint32_t new_sz = (sz < 64) ? 64 : sz;
+	
+	if ((new_sz & (new_sz - 1)) > 0)
+	{
+		// padded sizes must fit in 32 bits
+		if (new_sz > 0x80000000u)
+			return -1;
+		new_sz = next_power_2(new_sz);
+	}
+	
+	if (sz > 65536)
+	{
+		uint64_t *packed = (uint64_t*)aligned_malloc(new_sz * sizeof(uint64_t), 64);
+		if (packed == NULL)
+			return -1;
+		
+		for (i = 0; i < sz; i++)
+		{
+			packed[i] = ((uint64_t)data[i] << 32) | i;
+		}
+		
+		argsort_packed64(packed, idx, sz, dir);
+		
+		aligned_free(packed);
+		return 0;
+	}
+	
+	// a real lane can only equal the padding when it is all 0's or 
+	// when sz == 65536, where there is no padding.
+	uint32_t *packed = (uint32_t*)aligned_malloc(new_sz * sizeof(uint32_t), 64);
+	if (packed == NULL)
+		return -1;
+	uint32_t pad = (dir == 0) ? 0xffffffff : 0;
+	__m512i vidx = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 
+		8, 9, 10, 11, 12, 13, 14, 15);
+	__m512i vinc = _mm512_set1_epi32(16);
+	__m512i vmask = _mm512_set1_epi32(0xffff);
+	
+	for (i = 0; i + 16 <= sz; i += 16)
+	{
+		__m512i k = _mm512_cvtepu16_epi32(_mm256_loadu_si256((__m256i *)(data + i)));
+		_mm512_store_si512(packed + i, _mm512_or_si512(_mm512_slli_epi32(k, 16), vidx));
+		vidx = _mm512_add_epi32(vidx, vinc);
+	}
+	for ( ; i < sz; i++)
+	{
+		packed[i] = ((uint32_t)data[i] << 16) | i;
+	}
+	for ( ; i < new_sz; i++)
+	{
+		packed[i] = pad;
+	}
+	
+	bitonic_sort32(packed, new_sz, dir);
+	
+	for (i = 0; i + 16 <= sz; i += 16)
+	{
+		_mm512_storeu_si512(idx + i, _mm512_and_si512(_mm512_load_si512(packed + i), vmask));
+	}
+	for ( ; i < sz; i++)
+	{
+		idx[i] = packed[i] & 0xffff;
+	}
+	
+	aligned_free(packed);
+	return 0;
+}
+
+AVX512_END
+
+AVX2_BEGIN
+
+// AVX2 versions of the base cases, for sort() and sort32() on cpus
+// without AVX-512.  The same immediate swaps map onto 256-bit vectors
+// (4 x 64-bit or 8 x 32-bit lanes) and the networks are written once,
+// as loops over the stages that the compiler unrolls completely, so 
+// every blend mask is an immediate and the data stays in registers.  
+// The networks sort ascending; descending sorts complement the keys
+// on the way in and out.  There are no unsigned 64-bit compares in 
+// AVX2, so the 64-bit keys are also biased by the sign bit.  Loads and
+// stores are unaligned.
+#define SWAP32_AVX2(x) _mm256_shuffle_epi32((x), 0xB1)
+#define SWAP64_AVX2(x) _mm256_shuffle_epi32((x), 0x4E)
+#define SWAP128_AVX2(x) _mm256_permute4x64_epi64((x), 0x4E)
+
+// does element e take the larger of the pair (e, e ^ j) in stage k
+#define TAKES_MAX(e, j, k) ((((e) & (j)) != 0) ^ (((e) & (k)) != 0))
+#define TAKES_MAX_8x32(e, j, k) (TAKES_MAX((e), j, k) | (TAKES_MAX((e) + 1, j, k) << 1) | \
+	(TAKES_MAX((e) + 2, j, k) << 2) | (TAKES_MAX((e) + 3, j, k) << 3) | \
+	(TAKES_MAX((e) + 4, j, k) << 4) | (TAKES_MAX((e) + 5, j, k) << 5) | \
+	(TAKES_MAX((e) + 6, j, k) << 6) | (TAKES_MAX((e) + 7, j, k) << 7))
+
+static __inline __attribute__((always_inline)) __m256i blend8x32_avx2(__m256i a, __m256i b, int m)
+{
+	// _mm256_blend_epi32 needs a literal immediate even where the 
+	// loops are not unrolled (-O0, clang), so spell out the masks 
+	// the within-register stages use: 0x66, 0x5A, 0x3C for k < 8, 
+	// and for k >= 8 the j mask or its complement.
+	switch (m)
+	{
+	case 0x66: return _mm256_blend_epi32(a, b, 0x66);
+	case 0x5A: return _mm256_blend_epi32(a, b, 0x5A);
+	case 0x3C: return _mm256_blend_epi32(a, b, 0x3C);
+	case 0xAA: return _mm256_blend_epi32(a, b, 0xAA);
+	case 0x55: return _mm256_blend_epi32(a, b, 0x55);
+	case 0xCC: return _mm256_blend_epi32(a, b, 0xCC);
+	case 0x33: return _mm256_blend_epi32(a, b, 0x33);
+	case 0xF0: return _mm256_blend_epi32(a, b, 0xF0);
+	default: return _mm256_blend_epi32(a, b, 0x0F);
+	}
+}
+
+static __inline __attribute__((always_inline)) void bitonic_net32_avx2(__m256i *v, int nreg, int lg)
+{
+	// ascending bitonic sort of the 8 * nreg = 2^lg keys in v
+	int kb, jb, r;
+	
+#pragma GCC unroll 8
+	for (kb = 1; kb <= lg; kb++)
+	{
+#pragma GCC unroll 8
+		for (jb = kb - 1; jb >= 0; jb--)
+		{
+			int k = 1 << kb;
+			int j = 1 << jb;
+			
+			if (j >= 8)
+			{
+				// compare/swap between registers
+#pragma GCC unroll 16
+				for (r = 0; r < nreg; r++)
+				{
+					if ((r & (j / 8)) == 0)
+					{
+						int p = r + j / 8;
+						__m256i mn = _mm256_min_epu32(v[r], v[p]);
+						__m256i mx = _mm256_max_epu32(v[r], v[p]);
+						
+						v[r] = (((r * 8) & k) == 0) ? mn : mx;
+						v[p] = (((r * 8) & k) == 0) ? mx : mn;
+					}
+				}
+			}
+			else
+			{
+				// compare/swap within registers
+#pragma GCC unroll 16
+				for (r = 0; r < nreg; r++)
+				{
+					__m256i sw = (j == 1) ? SWAP32_AVX2(v[r]) :
+						(j == 2) ? SWAP64_AVX2(v[r]) : SWAP128_AVX2(v[r]);
+					__m256i mn = _mm256_min_epu32(v[r], sw);
+					__m256i mx = _mm256_max_epu32(v[r], sw);
+					
+					v[r] = blend8x32_avx2(mn, mx, TAKES_MAX_8x32(r * 8, j, k));
+				}
+			}
+		}
+	}
+	return;
+}
+
+static __inline __attribute__((always_inline)) void bitonic_net64_avx2(__m256i *v, int nreg, int lg)
+{
+	// ascending bitonic sort of the 4 * nreg = 2^lg sign-biased keys in v
+	int kb, jb, r;
+	
+#pragma GCC unroll 8
+	for (kb = 1; kb <= lg; kb++)
+	{
+#pragma GCC unroll 8
+		for (jb = kb - 1; jb >= 0; jb--)
+		{
+			int k = 1 << kb;
+			int j = 1 << jb;
+			
+			if (j >= 4)
+			{
+#pragma GCC unroll 16
+				for (r = 0; r < nreg; r++)
+				{
+					if ((r & (j / 4)) == 0)
+					{
+						int p = r + j / 4;
+						__m256i gt = _mm256_cmpgt_epi64(v[r], v[p]);
+						__m256i mn = _mm256_blendv_epi8(v[r], v[p], gt);
+						__m256i mx = _mm256_blendv_epi8(v[p], v[r], gt);
+						
+						v[r] = (((r * 4) & k) == 0) ? mn : mx;
+						v[p] = (((r * 4) & k) == 0) ? mx : mn;
+					}
+				}
+			}
+			else
+			{
+				// keep v where it already holds the element this lane wants
+#pragma GCC unroll 16
+				for (r = 0; r < nreg; r++)
+				{
+					__m256i sw = (j == 1) ? SWAP64_AVX2(v[r]) : SWAP128_AVX2(v[r]);
+					__m256i gt = _mm256_cmpgt_epi64(v[r], sw);
+					__m256i tm = _mm256_setr_epi64x(-TAKES_MAX(r * 4, j, k), 
+						-TAKES_MAX(r * 4 + 1, j, k), -TAKES_MAX(r * 4 + 2, j, k), 
+						-TAKES_MAX(r * 4 + 3, j, k));
+					
+					v[r] = _mm256_blendv_epi8(v[r], sw, _mm256_xor_si256(gt, tm));
+				}
+			}
+		}
+	}
+	return;
+}
+
+static __inline __attribute__((always_inline)) void sort32_regs_avx2(uint32_t *data, int nreg, int lg, __m256i f)
+{
+	// load, xor with f, sort up, xor with f, store
+	__m256i v[16];
+	int r;
+	
+#pragma GCC unroll 16
+	for (r = 0; r < nreg; r++)
+		v[r] = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(data + 8 * r)), f);
+	bitonic_net32_avx2(v, nreg, lg);
+#pragma GCC unroll 16
+	for (r = 0; r < nreg; r++)
+		_mm256_storeu_si256((__m256i *)(data + 8 * r), _mm256_xor_si256(v[r], f));
+	return;
+}
+
+static __inline __attribute__((always_inline)) void sort64_regs_avx2(uint64_t *data, __m256i f)
+{
+	__m256i v[16];
+	int r;
+	
+#pragma GCC unroll 16
+	for (r = 0; r < 16; r++)
+		v[r] = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(data + 4 * r)), f);
+	bitonic_net64_avx2(v, 16, 6);
+#pragma GCC unroll 16
+	for (r = 0; r < 16; r++)
+		_mm256_storeu_si256((__m256i *)(data + 4 * r), _mm256_xor_si256(v[r], f));
+	return;
+}
+
+void bitonic_sort32_dir_64_avx2(uint32_t *data, int dir)
+{
+	sort32_regs_avx2(data, 8, 6, _mm256_set1_epi32(dir ? -1 : 0));
+}
+
+void bitonic_sort32_dir_128_avx2(uint32_t *data, int dir)
+{
+	sort32_regs_avx2(data, 16, 7, _mm256_set1_epi32(dir ? -1 : 0));
+}
+
+void bitonic_sort_dir_64_avx2(uint64_t *data, int dir)
+{
+	sort64_regs_avx2(data, _mm256_set1_epi64x(dir ? 0x7fffffffffffffffll : (long long)0x8000000000000000ull));
+}
+
+// the fallback sorts work on keys that are already complemented 
+// (descending sorts) and biased (64-bit), i.e. they always sort up,
+// and 64-bit keys compare as signed.
+static __inline void merge8x8_32_avx2(__m256i *a, __m256i *b)
+{
+	// a and b sorted up: a gets the 8 smallest of both, b the
+	// 8 largest, both sorted up
+	__m256i r = _mm256_permutevar8x32_epi32(*b, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+	__m256i lo = _mm256_min_epu32(*a, r);
+	__m256i hi = _mm256_max_epu32(*a, r);
+	__m256i s1, s2;
+	
+	s1 = SWAP128_AVX2(lo);
+	s2 = SWAP128_AVX2(hi);
+	lo = _mm256_blend_epi32(_mm256_min_epu32(lo, s1), _mm256_max_epu32(lo, s1), 0xF0);
+	hi = _mm256_blend_epi32(_mm256_min_epu32(hi, s2), _mm256_max_epu32(hi, s2), 0xF0);
+	s1 = SWAP64_AVX2(lo);
+	s2 = SWAP64_AVX2(hi);
+	lo = _mm256_blend_epi32(_mm256_min_epu32(lo, s1), _mm256_max_epu32(lo, s1), 0xCC);
+	hi = _mm256_blend_epi32(_mm256_min_epu32(hi, s2), _mm256_max_epu32(hi, s2), 0xCC);
+	s1 = SWAP32_AVX2(lo);
+	s2 = SWAP32_AVX2(hi);
+	*a = _mm256_blend_epi32(_mm256_min_epu32(lo, s1), _mm256_max_epu32(lo, s1), 0xAA);
+	*b = _mm256_blend_epi32(_mm256_min_epu32(hi, s2), _mm256_max_epu32(hi, s2), 0xAA);
+	return;
+}
+
+static __inline void merge4x4_64_avx2(__m256i *a, __m256i *b)
+{
+	// as merge8x8_32_avx2 for 4 signed 64-bit keys
+	__m256i r = _mm256_permute4x64_epi64(*b, 0x1B);
+	__m256i gt = _mm256_cmpgt_epi64(*a, r);
+	__m256i lo = _mm256_blendv_epi8(*a, r, gt);
+	__m256i hi = _mm256_blendv_epi8(r, *a, gt);
+	__m256i m2 = _mm256_setr_epi64x(0, 0, -1, -1);
+	__m256i m1 = _mm256_setr_epi64x(0, -1, 0, -1);
+	__m256i s1, s2;
+	
+	s1 = SWAP128_AVX2(lo);
+	s2 = SWAP128_AVX2(hi);
+	lo = _mm256_blendv_epi8(lo, s1, _mm256_xor_si256(_mm256_cmpgt_epi64(lo, s1), m2));
+	hi = _mm256_blendv_epi8(hi, s2, _mm256_xor_si256(_mm256_cmpgt_epi64(hi, s2), m2));
+	s1 = SWAP64_AVX2(lo);
+	s2 = SWAP64_AVX2(hi);
+	*a = _mm256_blendv_epi8(lo, s1, _mm256_xor_si256(_mm256_cmpgt_epi64(lo, s1), m1));
+	*b = _mm256_blendv_epi8(hi, s2, _mm256_xor_si256(_mm256_cmpgt_epi64(hi, s2), m1));
+	return;
+}
+
+static void merge_scalar64(int64_t *out, int64_t *a, size_t na, int64_t *b, size_t nb)
+{
+	size_t ia = 0, ib = 0;
+	
+	while ((ia < na) && (ib < nb))
+	{
+		int tb = (a[ia] > b[ib]);
+		
+		*out++ = tb ? b[ib] : a[ia];
+		ib += tb;
+		ia += 1 - tb;
+	}
+	memcpy(out, a + ia, (na - ia) * sizeof(int64_t));
+	memcpy(out + (na - ia), b + ib, (nb - ib) * sizeof(int64_t));
+	return;
+}
+
+static void merge_scalar32(uint32_t *out, uint32_t *a, size_t na, uint32_t *b, size_t nb)
 {
-	if (sz == 64)
+	size_t ia = 0, ib = 0;
+	
+	while ((ia < na) && (ib < nb))
 	{
-		// base case: do the hardcoded 128-element sort
-		bitonic_sort32_dir_64(data, dir);
-		return;
+		int tb = (a[ia] > b[ib]);
+		
+		*out++ = tb ? b[ib] : a[ia];
+		ib += tb;
+		ia += 1 - tb;
 	}
-	else if (sz == 128)
+	memcpy(out, a + ia, (na - ia) * sizeof(uint32_t));
+	memcpy(out + (na - ia), b + ib, (nb - ib) * sizeof(uint32_t));
+	return;
+}
+
+static void merge_forward64_avx2(int64_t *out, int64_t *a, size_t na, int64_t *b, size_t nb)
+{
+	// out-of-place merge, 4 at a time while both runs have 4 left, 
+	// then the carry is merged with the shorter remainder and that
+	// with the longer one.
+	int64_t small[8];
+	size_t ia = 0, ib = 0, o = 0;
+	
+	if ((na >= 4) && (nb >= 4))
 	{
-		// base case: do the hardcoded 128-element sort
-		bitonic_sort32_dir_128(data, dir);
+		__m256i v = _mm256_loadu_si256((__m256i *)a);
+		__m256i c = _mm256_loadu_si256((__m256i *)b);
+		int64_t carry[4];
+		
+		ia = ib = 4;
+		merge4x4_64_avx2(&v, &c);
+		_mm256_storeu_si256((__m256i *)out, v);
+		o = 4;
+		while ((ia + 4 <= na) && (ib + 4 <= nb))
+		{
+			if (a[ia] > b[ib])
+			{
+				v = _mm256_loadu_si256((__m256i *)(b + ib));
+				ib += 4;
+			}
+			else
+			{
+				v = _mm256_loadu_si256((__m256i *)(a + ia));
+				ia += 4;
+			}
+			merge4x4_64_avx2(&v, &c);
+			_mm256_storeu_si256((__m256i *)(out + o), v);
+			o += 4;
+		}
+		_mm256_storeu_si256((__m256i *)carry, c);
+		
+		if ((na - ia) < (nb - ib))
+		{
+			merge_scalar64(small, carry, 4, a + ia, na - ia);
+			merge_scalar64(out + o, small, 4 + na - ia, b + ib, nb - ib);
+		}
+		else
+		{
+			merge_scalar64(small, carry, 4, b + ib, nb - ib);
+			merge_scalar64(out + o, small, 4 + nb - ib, a + ia, na - ia);
+		}
 		return;
 	}
-	else if (sz == 256)
+	
+	merge_scalar64(out, a, na, b, nb);
+	return;
+}
+
+static void merge_forward32_avx2(uint32_t *out, uint32_t *a, size_t na, uint32_t *b, size_t nb)
+{
+	// as merge_forward64_avx2, 8 at a time
+	uint32_t small[16];
+	size_t ia = 0, ib = 0, o = 0;
+	
+	if ((na >= 8) && (nb >= 8))
 	{
-		// base case: do the hardcoded 256-element sort
-		bitonic_sort32_dir_256(data, dir);
+		__m256i v = _mm256_loadu_si256((__m256i *)a);
+		__m256i c = _mm256_loadu_si256((__m256i *)b);
+		uint32_t carry[8];
+		
+		ia = ib = 8;
+		merge8x8_32_avx2(&v, &c);
+		_mm256_storeu_si256((__m256i *)out, v);
+		o = 8;
+		while ((ia + 8 <= na) && (ib + 8 <= nb))
+		{
+			if (a[ia] > b[ib])
+			{
+				v = _mm256_loadu_si256((__m256i *)(b + ib));
+				ib += 8;
+			}
+			else
+			{
+				v = _mm256_loadu_si256((__m256i *)(a + ia));
+				ia += 8;
+			}
+			merge8x8_32_avx2(&v, &c);
+			_mm256_storeu_si256((__m256i *)(out + o), v);
+			o += 8;
+		}
+		_mm256_storeu_si256((__m256i *)carry, c);
+		
+		if ((na - ia) < (nb - ib))
+		{
+			merge_scalar32(small, carry, 8, a + ia, na - ia);
+			merge_scalar32(out + o, small, 8 + na - ia, b + ib, nb - ib);
+		}
+		else
+		{
+			merge_scalar32(small, carry, 8, b + ib, nb - ib);
+			merge_scalar32(out + o, small, 8 + nb - ib, a + ia, na - ia);
+		}
 		return;
 	}
-
-	// two half-size bitonic sorts,
-	// with opposite directions.
-	bitonic_sort32(data, sz / 2, 0);
-	bitonic_sort32(data + sz / 2, sz / 2, 1);
-
-	// merge in the specified direction
-	bitonic_merge32(data, sz, dir);
-
+	
+	merge_scalar32(out, a, na, b, nb);
 	return;
 }
 
-void sort32(uint32_t *data, uint32_t sz, int dir)
+static int sort_avx2(uint64_t *data, size_t sz, int dir)
 {
-	// top level sort dealing with two things:
-	// 1) the bitonic sort function requires the data array
-	// to be aligned and
-	// 2) the bitonic sort works on a power-of-2 sized array
-	// here we make sure we feed the bitonic sort function
-	// an array that satifies those requirements.
-	int is_aligned = (((uint64_t)data & 0x3full) == 0);
-	if (is_aligned && ((sz & (sz - 1)) == 0))
+	// bias (and for dir 1 complement) the keys, 64-element base cases
+	// with the last one padded in a buffer, bottom-up merges between 
+	// data and a scratch array, and undo the bias.
+	uint64_t f = dir ? 0x7fffffffffffffffull : 0x8000000000000000ull;
+	__m256i zero = _mm256_setzero_si256();
+	uint64_t buf[64];
+	uint64_t *scratch = NULL, *src, *dst;
+	size_t i, w;
+	
+	if (sz > 64)
 	{
-		// meets both requirements as-is
-		bitonic_sort32(data, sz, dir);
-		return;
+		scratch = (uint64_t*)malloc(sz * sizeof(uint64_t));
+		if (scratch == NULL)
+			return -1;
 	}
 	
-	// otherwise we need to copy to an aligned buffer and/or 
-	// change the buffer size
-	uint32_t new_sz = sz;
-	if ((sz & (sz - 1)) > 0)
+	for (i = 0; i < sz; i++)
+		data[i] ^= f;
+	
+	for (i = 0; i + 64 <= sz; i += 64)
+		sort64_regs_avx2(data + i, zero);
+	
+	if (i < sz)
+	{
+		size_t j;
+		
+		memcpy(buf, data + i, (sz - i) * sizeof(uint64_t));
+		for (j = sz - i; j < 64; j++)
+			buf[j] = 0x7fffffffffffffffull;
+		sort64_regs_avx2(buf, zero);
+		memcpy(data + i, buf, (sz - i) * sizeof(uint64_t));
+	}
+	
+	src = data;
+	dst = scratch;
+	for (w = 64; w < sz; w *= 2)
 	{
-		new_sz = my_clz32(sz);
-		if (new_sz == 0)
+		uint64_t *t;
+		
+		for (i = 0; i < sz; i += 2 * w)
 		{
-			printf("buffer too big, sz must be <= 2^31 in sort()\n");
-			exit(0);
+			size_t na = (sz - i < w) ? sz - i : w;
+			size_t nb = (sz - i - na < w) ? sz - i - na : w;
+			
+			merge_forward64_avx2((int64_t *)dst + i, (int64_t *)src + i, na, 
+				(int64_t *)src + i + na, nb);
 		}
-		new_sz = 1 << (32 - new_sz + 1);
+		t = src;
+		src = dst;
+		dst = t;
 	}
-		
-	uint32_t *adata;
 	
-	if (!is_aligned)
+	if (src != data)
+		memcpy(data, src, sz * sizeof(uint64_t));
+	for (i = 0; i < sz; i++)
+		data[i] ^= f;
+	
+	free(scratch);
+	return 0;
+}
+
+static int sort32_avx2(uint32_t *data, uint32_t sz, int dir)
+{
+	// as sort_avx2, with 128-element base cases
+	uint32_t f = dir ? 0xffffffff : 0;
+	__m256i zero = _mm256_setzero_si256();
+	uint32_t buf[128];
+	uint32_t *scratch = NULL, *src, *dst;
+	size_t i, w;
+	
+	if (sz > 128)
 	{
-		adata = (uint32_t*)aligned_malloc(new_sz * sizeof(uint32_t), 64);
-		memcpy(adata, data, sz * sizeof(uint32_t));
+		scratch = (uint32_t*)malloc((size_t)sz * sizeof(uint32_t));
+		if (scratch == NULL)
+			return -1;
 	}
-	else
+	
+	if (dir)
 	{
-		adata = data;
+		for (i = 0; i < sz; i++)
+			data[i] ^= f;
 	}
 	
-	if ((new_sz - sz) > 0)
+	for (i = 0; i + 128 <= sz; i += 128)
+		sort32_regs_avx2(data + i, 16, 7, zero);
+	
+	if (i < sz)
 	{
-		if (dir == 0)
-			memset(adata + sz, 0xff, (new_sz - sz));
+		memcpy(buf, data + i, (sz - i) * sizeof(uint32_t));
+		memset(buf + (sz - i), 0xff, (128 - (sz - i)) * sizeof(uint32_t));
+		if (sz - i <= 64)
+			sort32_regs_avx2(buf, 8, 6, zero);
 		else
-			memset(adata + sz, 0, (new_sz - sz));
+			sort32_regs_avx2(buf, 16, 7, zero);
+		memcpy(data + i, buf, (sz - i) * sizeof(uint32_t));
 	}
 	
-	bitonic_sort32(adata, new_sz, dir);
+	src = data;
+	dst = scratch;
+	for (w = 128; w < sz; w *= 2)
+	{
+		uint32_t *t;
+		
+		for (i = 0; i < sz; i += 2 * w)
+		{
+			size_t na = (sz - i < w) ? sz - i : w;
+			size_t nb = (sz - i - na < w) ? sz - i - na : w;
+			
+			merge_forward32_avx2(dst + i, src + i, na, src + i + na, nb);
+		}
+		t = src;
+		src = dst;
+		dst = t;
+	}
 	
-	if (!is_aligned)
+	if (src != data)
+		memcpy(data, src, (size_t)sz * sizeof(uint32_t));
+	if (dir)
 	{
-		memcpy(data, adata, sz * sizeof(uint32_t));
-		aligned_free(adata);
+		for (i = 0; i < sz; i++)
+			data[i] ^= f;
 	}
 	
+	free(scratch);
+	return 0;
+}
+
+AVX2_END
+
+// runtime dispatch for sort() and sort32().  The level is detected once
+// and can be lowered with sort_set_cpu_level, e.g. to test the fallbacks.
+#define SORT_CPU_SCALAR 0
+#define SORT_CPU_AVX2 1
+#define SORT_CPU_AVX512 2
+
+static int sort_cpu = -1;
+
+int sort_cpu_level(void)
+{
+	if (sort_cpu < 0)
+	{
+#if defined(__GNUC__) && defined(__x86_64__)
+		int bits;
+		
+		__builtin_cpu_init();
+		// both vector levels are also compiled for bmi, bmi2, lzcnt and popcnt
+		bits = __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2") &&
+			__builtin_cpu_supports("lzcnt") && __builtin_cpu_supports("popcnt");
+		if (bits && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd") &&
+			__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq") &&
+			__builtin_cpu_supports("avx512vl"))
+			sort_cpu = SORT_CPU_AVX512;
+		else if (bits && __builtin_cpu_supports("avx2"))
+			sort_cpu = SORT_CPU_AVX2;
+		else
+			sort_cpu = SORT_CPU_SCALAR;
+#else
+		sort_cpu = SORT_CPU_AVX512;
+#endif
+	}
+	return sort_cpu;
+}
+
+void sort_set_cpu_level(int level)
+{
+	// can only go down from what the cpu supports
+	sort_cpu = -1;
+	if (level < sort_cpu_level())
+		sort_cpu = level;
 	return;
 }
 
-void parsort(uint64_t *data, uint32_t sz, int dir, int threads)
+static int sort_adaptive = 0;
+
+void sort_set_adaptive(int on)
 {
-	// REQUIRED: threads and sz both powers of 2 and
-	// (threads * 64) divides sz
-	uint32_t bitonic_sort_size = sz / threads;
-	uint32_t j;
-	
-	omp_set_num_threads(threads);
+	// when on, sort() and sort32() check for presorted input
+	// first (AVX-512 only).  Off by default.
+	sort_adaptive = on;
+	return;
+}
 
-#pragma omp parallel for
-	for (j = 0; j < sz / bitonic_sort_size; j++) {
-		// alternating up/down sorts so we can finish using merge only
-		bitonic_sort(&data[j * bitonic_sort_size], bitonic_sort_size, j & 1);
+static int sort_scalar(uint64_t *data, size_t sz, int dir)
+{
+	size_t i;
+	
+	qsort(data, sz, sizeof(uint64_t), &qcomp_uint64);
+	if (dir)
+	{
+		for (i = 0; i < sz / 2; i++)
+		{
+			uint64_t t = data[i];
+			data[i] = data[sz - 1 - i];
+			data[sz - 1 - i] = t;
+		}
 	}
+	return 0;
+}
+
+static int sort32_scalar(uint32_t *data, uint32_t sz, int dir)
+{
+	uint32_t i;
 	
-	if (threads == 1)
-		return;
-		
-	bitonic_sort_size *= 2;
-	while (bitonic_sort_size < sz)
+	qsort(data, sz, sizeof(uint32_t), &qcomp_uint32);
+	if (dir)
 	{
-#pragma omp parallel for
-		for (j = 0; j < sz / bitonic_sort_size; j++) {
-			// up/down merges of the previous up/down sorts, output is up/down sorted
-			bitonic_merge(&data[j * bitonic_sort_size], bitonic_sort_size, j & 1);
+		for (i = 0; i < sz / 2; i++)
+		{
+			uint32_t t = data[i];
+			data[i] = data[sz - 1 - i];
+			data[sz - 1 - i] = t;
 		}
-		bitonic_sort_size *= 2;
 	}
+	return 0;
+}
+
+int sort(uint64_t *data, size_t sz, int dir)
+{
+	int level = sort_cpu_level();
+	int ret, done;
 	
-	// final merge in the specified direction
-	bitonic_merge(data, sz, dir);
+	if ((level == SORT_CPU_AVX512) && sort_adaptive)
+	{
+		ret = sort_adaptive64(data, sz, dir, &done);
+		if (done)
+			return ret;
+	}
 	
-	return;
+	if ((level == SORT_CPU_AVX512) && (sz >= RADIX_MIN))
+		return radix_sort(data, sz, dir);
+	else if (level == SORT_CPU_AVX512)
+		return sort_avx512(data, sz, dir);
+	else if (level == SORT_CPU_AVX2)
+		return sort_avx2(data, sz, dir);
+	return sort_scalar(data, sz, dir);
+}
+
+int sort32(uint32_t *data, uint32_t sz, int dir)
+{
+	int level = sort_cpu_level();
+	int ret, done;
+	
+	if ((level == SORT_CPU_AVX512) && sort_adaptive)
+	{
+		ret = sort_adaptive32(data, sz, dir, &done);
+		if (done)
+			return ret;
+	}
+	
+	if ((level == SORT_CPU_AVX512) && (sz >= RADIX_MIN32))
+		return radix_sort32(data, sz, dir);
+	else if (level == SORT_CPU_AVX512)
+		return sort32_avx512(data, sz, dir);
+	else if (level == SORT_CPU_AVX2)
+		return sort32_avx2(data, sz, dir);
+	return sort32_scalar(data, sz, dir);
 }
 
+AVX512_BEGIN
+
 // for 20M element problems
 #ifndef SH
 #define SH 8
@@ -6646,6 +11538,11 @@ int main64(int argc, char ** argv)
 	}
 
 	uint64_t *loc_keys = (uint64 *)aligned_malloc(num_sort * sizeof(uint64), 64);
+	uint64_t *chk_keys = (uint64 *)aligned_malloc(num_sort * sizeof(uint64), 64);
+	uint64_t *chk_vals = (uint64 *)aligned_malloc(num_sort * sizeof(uint64), 64);
+	uint32_t *chk_idx = (uint32 *)aligned_malloc(num_sort * sizeof(uint32), 64);
+	double *chk_dbl = (double *)aligned_malloc(num_sort * sizeof(double), 64);
+	size_t chk_offs[9];
 	
 	for (n = 0; n < num_reps; n++) {
 		
@@ -6687,6 +11584,119 @@ int main64(int argc, char ** argv)
 	printf("sort %u x %u-bit keys in average of %lf seconds\n", 
 		num_sort, key_bits, tseconds / (double)num_reps);
 	
+	tseconds = 0.0;
+	for (n = 0; n < num_reps; n++) {
+		
+		for (i = 0; i < num_sort; i++) {
+			uint64 key = (uint64)get_rand(&seed1, &seed2) << 32 |
+					get_rand(&seed1, &seed2);
+					
+			loc_keys[i] = key >> (64 - key_bits);
+		}
+		
+		seconds = get_cpu_time();
+		
+		sort_batch(loc_keys, bitonic_sort_size, num_lists, 0, 1);
+		
+		tseconds += (get_cpu_time() - seconds);
+		
+		for (i = 0; i < num_lists; i++) {
+			for (j = 1; j < bitonic_sort_size; j++) {
+				if (loc_keys[i * bitonic_sort_size + j] < loc_keys[i * bitonic_sort_size + j-1]) {
+					printf("sort_batch error\n");
+					goto done;
+				}
+			}
+		}
+	}
+	
+	printf("sort_batch %u x %u-bit keys in average of %lf seconds\n", 
+		num_sort, key_bits, tseconds / (double)num_reps);
+	
+	// check the other 64-bit entry points once on fresh keys:
+	// key-value, argsort, signed, float, segment and merge.
+	for (i = 0; i < num_sort; i++) {
+		uint64 key = (uint64)get_rand(&seed1, &seed2) << 32 |
+				get_rand(&seed1, &seed2);
+				
+		loc_keys[i] = key >> (64 - key_bits);
+		chk_keys[i] = loc_keys[i];
+		chk_vals[i] = i;
+	}
+	
+	sort_kv(chk_keys, chk_vals, num_sort, 0);
+	
+	for (j = 0; j < num_sort; j++) {
+		if ((chk_keys[j] != loc_keys[chk_vals[j]]) || 
+			((j > 0) && (chk_keys[j] < chk_keys[j-1]))) {
+			printf("sort_kv error at position %u\n", j);
+			goto done;
+		}
+	}
+	
+	argsort(loc_keys, chk_idx, num_sort, 0);
+	
+	for (j = 1; j < num_sort; j++) {
+		if (loc_keys[chk_idx[j]] < loc_keys[chk_idx[j-1]]) {
+			printf("argsort error at position %u\n", j);
+			goto done;
+		}
+	}
+	
+	// the same keys centred on 0, as int64 and as double
+	for (i = 0; i < num_sort; i++) {
+		chk_keys[i] = loc_keys[i] - (1ull << (key_bits - 1));
+		chk_dbl[i] = (double)(int64_t)chk_keys[i];
+	}
+	
+	sorti64((int64_t *)chk_keys, num_sort, 0);
+	sortf64(chk_dbl, num_sort, 0);
+	
+	for (j = 1; j < num_sort; j++) {
+		if ((int64_t)chk_keys[j] < (int64_t)chk_keys[j-1]) {
+			printf("sorti64 error at position %u\n", j);
+			goto done;
+		}
+		if (chk_dbl[j] < chk_dbl[j-1]) {
+			printf("sortf64 error at position %u\n", j);
+			goto done;
+		}
+	}
+	
+	// segments of uneven sizes
+	for (i = 0; i <= 8; i++) {
+		chk_offs[i] = (uint64)num_sort * i * i / 64;
+	}
+	memcpy(chk_keys, loc_keys, num_sort * sizeof(uint64));
+	
+	sort_segments(chk_keys, chk_offs, 8, 0, 1);
+	
+	for (i = 0; i < 8; i++) {
+		for (j = chk_offs[i] + 1; j < chk_offs[i + 1]; j++) {
+			if (chk_keys[j] < chk_keys[j-1]) {
+				printf("sort_segments error at position %u\n", j);
+				goto done;
+			}
+		}
+	}
+	
+	// two sorted runs of different lengths
+	memcpy(chk_keys, loc_keys, num_sort * sizeof(uint64));
+	sort(chk_keys, num_sort / 3, 0);
+	sort(chk_keys + num_sort / 3, num_sort - num_sort / 3, 0);
+	
+	merge_sorted_u64(chk_keys, num_sort / 3, chk_keys + num_sort / 3, 
+		num_sort - num_sort / 3, chk_vals, 0);
+	
+	for (j = 1; j < num_sort; j++) {
+		if (chk_vals[j] < chk_vals[j-1]) {
+			printf("merge_sorted_u64 error at position %u\n", j);
+			goto done;
+		}
+	}
+	
+	printf("sort_kv, argsort, sorti64, sortf64, sort_segments and merge_sorted_u64 ok\n");
+	
 	tseconds = 0.0;
 	for (n = 0; n < num_reps; n++) {
 		
@@ -6738,6 +11748,10 @@ done:
 		num_sort, key_bits, tseconds / (double)num_reps);
 	
 	aligned_free(loc_keys);
+	aligned_free(chk_keys);
+	aligned_free(chk_vals);
+	aligned_free(chk_idx);
+	aligned_free(chk_dbl);
 	return 0;
 }
 
@@ -6753,8 +11767,6 @@ int main32(int argc, char ** argv)
 	uint32 seed1 = 0x11111;
 	uint32 seed2 = 0x22222;
 	
-	swap8bit_idx = _mm512_set1_epi64(0xefcdba8967452301);
-	
 	if ((argc < 5) || (argc > 6))
 	{
 		printf("usage: vecsort sort_sz_bits key_bits num_sort num_reps <seed>\n");
@@ -6785,6 +11797,11 @@ int main32(int argc, char ** argv)
 	}
 
 	uint32_t *loc_keys = (uint32 *)aligned_malloc(num_sort * sizeof(uint32), 64);
+	uint32_t *chk_keys = (uint32 *)aligned_malloc(num_sort * sizeof(uint32), 64);
+	uint32_t *chk_vals = (uint32 *)aligned_malloc(num_sort * sizeof(uint32), 64);
+	uint32_t *chk_idx = (uint32 *)aligned_malloc(num_sort * sizeof(uint32), 64);
+	float *chk_flt = (float *)aligned_malloc(num_sort * sizeof(float), 64);
+	uint32_t chk_offs[9];
 	
 	for (n = 0; n < num_reps; n++) {
 		
@@ -6834,6 +11851,88 @@ int main32(int argc, char ** argv)
 	printf("sort %u x %u-bit keys in average of %lf seconds\n", 
 		num_sort, key_bits, tseconds / (double)num_reps);
 	
+	// check the other 32-bit entry points once on fresh keys:
+	// key-value, argsort, signed, float, segment and merge.
+	for (i = 0; i < num_sort; i++) {
+		uint32 key = get_rand(&seed1, &seed2);
+		loc_keys[i] = key >> (32 - key_bits);
+		chk_keys[i] = loc_keys[i];
+		chk_vals[i] = i;
+	}
+	
+	sort_kv32(chk_keys, chk_vals, num_sort, 0);
+	
+	for (j = 0; j < num_sort; j++) {
+		if ((chk_keys[j] != loc_keys[chk_vals[j]]) || 
+			((j > 0) && (chk_keys[j] < chk_keys[j-1]))) {
+			printf("sort_kv32 error at position %u\n", j);
+			goto done;
+		}
+	}
+	
+	argsort32(loc_keys, chk_idx, num_sort, 0);
+	
+	for (j = 1; j < num_sort; j++) {
+		if (loc_keys[chk_idx[j]] < loc_keys[chk_idx[j-1]]) {
+			printf("argsort32 error at position %u\n", j);
+			goto done;
+		}
+	}
+	
+	// the same keys centred on 0, as int32 and as float
+	for (i = 0; i < num_sort; i++) {
+		chk_keys[i] = loc_keys[i] - (1u << (key_bits - 1));
+		chk_flt[i] = (float)(int32_t)chk_keys[i];
+	}
+	
+	sorti32((int32_t *)chk_keys, num_sort, 0);
+	sortf32(chk_flt, num_sort, 0);
+	
+	for (j = 1; j < num_sort; j++) {
+		if ((int32_t)chk_keys[j] < (int32_t)chk_keys[j-1]) {
+			printf("sorti32 error at position %u\n", j);
+			goto done;
+		}
+		if (chk_flt[j] < chk_flt[j-1]) {
+			printf("sortf32 error at position %u\n", j);
+			goto done;
+		}
+	}
+	
+	// segments of uneven sizes
+	for (i = 0; i <= 8; i++) {
+		chk_offs[i] = (uint32)((uint64)num_sort * i * i / 64);
+	}
+	memcpy(chk_keys, loc_keys, num_sort * sizeof(uint32));
+	
+	sort_segments32(chk_keys, chk_offs, 8, 0, 1);
+	
+	for (i = 0; i < 8; i++) {
+		for (j = chk_offs[i] + 1; j < chk_offs[i + 1]; j++) {
+			if (chk_keys[j] < chk_keys[j-1]) {
+				printf("sort_segments32 error at position %u\n", j);
+				goto done;
+			}
+		}
+	}
+	
+	// two sorted runs of different lengths
+	memcpy(chk_keys, loc_keys, num_sort * sizeof(uint32));
+	sort32(chk_keys, num_sort / 3, 0);
+	sort32(chk_keys + num_sort / 3, num_sort - num_sort / 3, 0);
+	
+	merge_sorted_u32(chk_keys, num_sort / 3, chk_keys + num_sort / 3, 
+		num_sort - num_sort / 3, chk_vals, 0);
+	
+	for (j = 1; j < num_sort; j++) {
+		if (chk_vals[j] < chk_vals[j-1]) {
+			printf("merge_sorted_u32 error at position %u\n", j);
+			goto done;
+		}
+	}
+	
+	printf("sort_kv32, argsort32, sorti32, sortf32, sort_segments32 and merge_sorted_u32 ok\n");
+	
 	tseconds = 0.0;
 	for (n = 0; n < num_reps; n++) {
 		
@@ -6883,6 +11982,10 @@ done:
 		num_sort, key_bits, tseconds / (double)num_reps);
 	
 	aligned_free(loc_keys);
+	aligned_free(chk_keys);
+	aligned_free(chk_vals);
+	aligned_free(chk_idx);
+	aligned_free(chk_flt);
 	return 0;
 }
 
@@ -6898,8 +12001,6 @@ int main16(int argc, char ** argv)
 	uint32 seed1 = 0x11111;
 	uint32 seed2 = 0x22222;
 	
-	swap8bit_idx = _mm512_set1_epi64(0xefcdba8967452301);
-	
 	if ((argc < 5) || (argc > 6))
 	{
 		printf("usage: vecsort sort_sz_bits key_bits num_sort num_reps <seed>\n");
@@ -6930,6 +12031,9 @@ int main16(int argc, char ** argv)
 	}
 
 	uint16_t *loc_keys = (uint16 *)aligned_malloc(num_sort * sizeof(uint16), 64);
+	uint16_t *chk_keys = (uint16 *)aligned_malloc(num_sort * sizeof(uint16), 64);
+	uint16_t *chk_out = (uint16 *)aligned_malloc(num_sort * sizeof(uint16), 64);
+	uint32_t *chk_idx = (uint32 *)aligned_malloc(num_sort * sizeof(uint32), 64);
 	
 	for (n = 0; n < num_reps; n++) {
 		
@@ -6977,6 +12081,53 @@ int main16(int argc, char ** argv)
 	printf("sort %u x %u-bit keys in average of %lf seconds\n", 
 		num_sort, key_bits, tseconds / (double)num_reps);
 	
+	// check the other 16-bit entry points once on fresh keys:
+	// argsort, signed and merge.
+	for (i = 0; i < num_sort; i++) {
+		uint32 key = get_rand(&seed1, &seed2) & 0xffff;
+		loc_keys[i] = key >> (16 - key_bits);
+	}
+	
+	argsort16(loc_keys, chk_idx, num_sort, 0);
+	
+	for (j = 1; j < num_sort; j++) {
+		if (loc_keys[chk_idx[j]] < loc_keys[chk_idx[j-1]]) {
+			printf("argsort16 error at position %u\n", j);
+			goto done;
+		}
+	}
+	
+	// the same keys centred on 0, as int16
+	for (i = 0; i < num_sort; i++) {
+		chk_keys[i] = loc_keys[i] - (1u << (key_bits - 1));
+	}
+	
+	sorti16((int16_t *)chk_keys, num_sort, 0);
+	
+	for (j = 1; j < num_sort; j++) {
+		if ((int16_t)chk_keys[j] < (int16_t)chk_keys[j-1]) {
+			printf("sorti16 error at position %u\n", j);
+			goto done;
+		}
+	}
+	
+	// two sorted runs of different lengths
+	memcpy(chk_keys, loc_keys, num_sort * sizeof(uint16));
+	sort16(chk_keys, num_sort / 3, 0);
+	sort16(chk_keys + num_sort / 3, num_sort - num_sort / 3, 0);
+	
+	merge_sorted_u16(chk_keys, num_sort / 3, chk_keys + num_sort / 3, 
+		num_sort - num_sort / 3, chk_out, 0);
+	
+	for (j = 1; j < num_sort; j++) {
+		if (chk_out[j] < chk_out[j-1]) {
+			printf("merge_sorted_u16 error at position %u\n", j);
+			goto done;
+		}
+	}
+	
+	printf("argsort16, sorti16 and merge_sorted_u16 ok\n");
+	
 	seed1 = 0x11111;
 	seed2 = 0x22222;
 	tseconds = 0.0;
@@ -7028,6 +12179,9 @@ done:
 		num_sort, key_bits, tseconds / (double)num_reps);
 	
 	aligned_free(loc_keys);
+	aligned_free(chk_keys);
+	aligned_free(chk_out);
+	aligned_free(chk_idx);
 	return 0;
 }
 
@@ -7481,6 +12635,8 @@ done:
 	return 0;
 }
 
+AVX512_END
+
 
 
 